@@ -0,0 +1,255 @@
+/*
+Copyright (C) 2016  Paweł Redman
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 3
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software Foundation,
+Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+*/
+
+// Runs what mapcat does (minus the command line handling and the worker
+// pool) several times over the same inputs and times map_read,
+// map_postprocess, map_merge and map_write separately. Each phase is
+// reported with the fastest and the median run, so that a single
+// disturbed run doesn't skew the numbers.
+
+#include "common.h"
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+
+#define MAX_RUNS 100
+#define MIN_TIME 1e-3 // in seconds, see print_results
+
+enum {
+	PHASE_READ,
+	PHASE_POSTPROCESS,
+	PHASE_MERGE,
+	PHASE_WRITE,
+	NUM_PHASES
+};
+
+static const char *phase_names[NUM_PHASES] = {
+	"read",
+	"postprocess",
+	"merge",
+	"write"
+};
+
+typedef struct {
+	double times[NUM_PHASES][MAX_RUNS]; // in seconds
+	uint64_t bytes_in, bytes_out;
+	uint64_t faces; // in the inputs, patch control points included
+} results_t;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static uint64_t count_faces(const entity_t *entity)
+{
+	const brush_t *brush;
+	uint64_t faces = 0;
+
+	elist_cfor(brush, entity->brushes, list) {
+		if (brush->patch)
+			faces += brush->patch->xres * brush->patch->yres;
+		else
+			faces += brush->num_faces;
+	}
+
+	return faces;
+}
+
+static uint64_t count_map_faces(const map_t *map)
+{
+	const entity_t *entity;
+	uint64_t faces = 0;
+
+	if (map->worldspawn)
+		faces += count_faces(map->worldspawn);
+
+	elist_cfor(entity, map->entities, list)
+		faces += count_faces(entity);
+
+	return faces;
+}
+
+static int run(char **inputs, int num_inputs, const char *output, int flags,
+               int jobs, results_t *results, int n)
+{
+	int rv = 1, i;
+	map_t map, input;
+	double start;
+	struct stat st;
+
+	map_init(&map);
+	results->faces = 0;
+
+	for (i = 0; i < num_inputs; i++) {
+		map_init(&input);
+
+		start = now();
+		if (map_read(&input, inputs[i], jobs)) {
+			fprintf(stderr, "error: couldn't read %s\n", inputs[i]);
+			map_free(&input);
+			goto out;
+		}
+		results->times[PHASE_READ][n] += now() - start;
+
+		results->faces += count_map_faces(&input);
+
+		start = now();
+		if (map_postprocess(&input)) {
+			map_free(&input);
+			goto out;
+		}
+		results->times[PHASE_POSTPROCESS][n] += now() - start;
+
+		start = now();
+		if (map_merge(&map, &input)) {
+			fprintf(stderr, "error: couldn't merge %s\n",
+			        inputs[i]);
+			goto out;
+		}
+		results->times[PHASE_MERGE][n] += now() - start;
+	}
+
+	start = now();
+	if (map_write(&map, output, flags, jobs)) {
+		fprintf(stderr, "error: couldn't write %s\n", output);
+		goto out;
+	}
+	results->times[PHASE_WRITE][n] += now() - start;
+
+	if (!stat(output, &st))
+		results->bytes_out = st.st_size;
+
+	rv = 0;
+out:
+	map_free(&map);
+	return rv;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+	double da = *(const double*)a, db = *(const double*)b;
+
+	return da < db ? -1 : da > db;
+}
+
+static void print_results(results_t *results, int runs)
+{
+	int p;
+	struct rusage usage;
+
+	printf("%-12s %10s %10s %10s %10s\n", "phase", "best ms", "median ms",
+	       "MB/s", "Mfaces/s");
+
+	for (p = 0; p < NUM_PHASES; p++) {
+		double *times = results->times[p], best, median;
+		uint64_t bytes;
+
+		qsort(times, runs, sizeof(double), compare_doubles);
+		best = times[0];
+		median = times[runs / 2];
+
+		if (p == PHASE_WRITE)
+			bytes = results->bytes_out;
+		else
+			bytes = results->bytes_in;
+
+		printf("%-12s %10.2f %10.2f", phase_names[p], best * 1e3,
+		       median * 1e3);
+
+		// throughputs of phases this short would be noise
+		if (best < MIN_TIME)
+			printf(" %10s %10s\n", "-", "-");
+		else
+			printf(" %10.1f %10.2f\n", bytes / best / 1e6,
+			       results->faces / best / 1e6);
+	}
+
+	getrusage(RUSAGE_SELF, &usage);
+	printf("in %.1f MB, out %.1f MB, %llu faces, peak RSS %ld KB\n",
+	       results->bytes_in / 1e6, results->bytes_out / 1e6,
+	       (unsigned long long)results->faces, usage.ru_maxrss);
+}
+
+static void print_usage(void)
+{
+	puts("usage: bench [-n runs] [-j jobs] [-c] [-r] -o outfile infile...");
+}
+
+int main(int argc, char **argv)
+{
+	int i, n, flags = 0, jobs = 1, runs = 5;
+	const char *output = NULL;
+	static results_t results;
+	char **inputs;
+	int num_inputs;
+
+	for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+		if (!strcmp(argv[i], "-c")) {
+			flags |= MAPCAT_COMPACT;
+		} else if (!strcmp(argv[i], "-r")) {
+			flags |= MAPCAT_REFORMAT;
+		} else if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+			runs = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "-j") && i + 1 < argc) {
+			jobs = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "-o") && i + 1 < argc) {
+			output = argv[++i];
+		} else {
+			print_usage();
+			return 1;
+		}
+	}
+
+	inputs = argv + i;
+	num_inputs = argc - i;
+
+	if (!output || !num_inputs || runs < 1 || runs > MAX_RUNS ||
+	    jobs < 1) {
+		print_usage();
+		return 1;
+	}
+
+	for (i = 0; i < num_inputs; i++) {
+		struct stat st;
+
+		if (stat(inputs[i], &st)) {
+			perror(inputs[i]);
+			return 1;
+		}
+
+		results.bytes_in += st.st_size;
+	}
+
+	// the first run warms up the page cache and the allocator
+	if (run(inputs, num_inputs, output, flags, jobs, &results, 0))
+		return 1;
+
+	memset(results.times, 0, sizeof(results.times));
+
+	for (n = 0; n < runs; n++)
+		if (run(inputs, num_inputs, output, flags, jobs, &results, n))
+			return 1;
+
+	print_results(&results, runs);
+	intern_free();
+	return 0;
+}
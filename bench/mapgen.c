@@ -0,0 +1,312 @@
+/*
+Copyright (C) 2016  Paweł Redman
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 3
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software Foundation,
+Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+*/
+
+// Generates synthetic .map files for benchmarking. The output depends only
+// on the options (the seed included), so a corpus can be regenerated
+// anywhere and compared across commits.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef struct {
+	uint64_t seed;
+	long worldspawn_brushes;
+	long entities;
+	long brushes; // per entity
+	long faces; // per brush
+	long patches; // percentage of brushes
+	long patch_width, patch_height;
+	long keys; // per entity, besides the classname
+	long comments; // percentage of lines preceded by a comment
+	long discards; // percentage of entities and brushes
+	const char *prefix; // NULL if none
+} options_t;
+
+static uint64_t rng_state;
+
+// xorshift64*
+static uint64_t rng(void)
+{
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return rng_state * 0x2545f4914f6cdd1dull;
+}
+
+static long rng_range(long min, long max)
+{
+	return min + (long)(rng() % (uint64_t)(max - min + 1));
+}
+
+static bool rng_percent(long percent)
+{
+	return (long)(rng() % 100) < percent;
+}
+
+static const char *shaders[] = {
+	"common/caulk",
+	"gothic_wall/iron01_e",
+	"gothic_floor/largerblock3b_ow",
+	"base_wall/metalfloor_wall_10",
+	"liquids/lavahell_750",
+	"sfx/beam",
+	"common/nodraw",
+	"base_trim/pewter_shiney"
+};
+
+static const char *classnames[] = {
+	"light",
+	"info_player_deathmatch",
+	"func_door",
+	"trigger_multiple",
+	"target_speaker",
+	"misc_model"
+};
+
+static const char *comments[] = {
+	"// brush from an older revision",
+	"// TODO: align the textures",
+	"// generated by mapgen"
+};
+
+static void maybe_comment(const options_t *opts)
+{
+	if (rng_percent(opts->comments))
+		puts(comments[rng() % (sizeof(comments) / sizeof(*comments))]);
+}
+
+static const char *random_shader(void)
+{
+	return shaders[rng() % (sizeof(shaders) / sizeof(*shaders))];
+}
+
+// editors write mostly integers with the odd fraction
+static void put_coord(void)
+{
+	long x = rng_range(-4096, 4096);
+
+	if (rng_percent(20))
+		printf(" %ld.%03ld", x, rng_range(1, 999));
+	else
+		printf(" %ld", x);
+}
+
+static void put_face(const options_t *opts)
+{
+	int i, j;
+
+	maybe_comment(opts);
+
+	for (i = 0; i < 3; i++) {
+		printf(i ? " (" : "(");
+		for (j = 0; j < 3; j++)
+			put_coord();
+		printf(" )");
+	}
+
+	printf(" %s %ld %ld %ld 0.5 0.5 0 0 0\n",
+	       rng_percent(opts->discards) ? "common/discard" :
+	       random_shader(), rng_range(-64, 64), rng_range(-64, 64),
+	       rng_range(0, 3) * 90);
+}
+
+static void put_patch(const options_t *opts)
+{
+	long x, y;
+
+	printf("patchDef2\n{\n%s\n( %ld %ld 0 0 0 )\n(\n", random_shader(),
+	       opts->patch_width, opts->patch_height);
+
+	// the first number is the number of rows
+	for (x = 0; x < opts->patch_width; x++) {
+		printf("(");
+
+		for (y = 0; y < opts->patch_height; y++) {
+			printf(" (");
+			put_coord();
+			put_coord();
+			put_coord();
+			printf(" %ld.%02ld %ld.%02ld )", x, rng_range(0, 99), y,
+			       rng_range(0, 99));
+		}
+
+		printf(" )\n");
+	}
+
+	printf(")\n}\n");
+}
+
+static void put_brushes(const options_t *opts, long count)
+{
+	long i, f;
+
+	for (i = 0; i < count; i++) {
+		maybe_comment(opts);
+		printf("// brush %ld\n{\n", i);
+
+		if (rng_percent(opts->patches))
+			put_patch(opts);
+		else
+			for (f = 0; f < opts->faces; f++)
+				put_face(opts);
+
+		printf("}\n");
+	}
+}
+
+static void put_entity(const options_t *opts, long n)
+{
+	long k;
+
+	printf("// entity %ld\n{\n", n);
+	printf("\"classname\" \"%s\"\n",
+	       classnames[rng() % (sizeof(classnames) / sizeof(*classnames))]);
+
+	if (rng_percent(opts->discards))
+		printf("\"mapcat_discard\" \"1\"\n");
+
+	for (k = 0; k < opts->keys; k++) {
+		maybe_comment(opts);
+
+		switch (k % 4) {
+		case 0:
+			printf("\"origin\" \"%ld %ld %ld\"\n",
+			       rng_range(-4096, 4096), rng_range(-4096, 4096),
+			       rng_range(-4096, 4096));
+			break;
+		case 1:
+			printf("\"targetname\" \"t%ld\"\n", n);
+			break;
+		case 2:
+			printf("\"target\" \"t%ld\"\n", rng_range(1, n));
+			break;
+		default:
+			printf("\"key%ld\" \"value %lu\"\n", k,
+			       (unsigned long)(rng() % 100000));
+		}
+	}
+
+	put_brushes(opts, opts->brushes);
+	printf("}\n");
+}
+
+static void print_usage(void)
+{
+	puts("usage: mapgen [-s seed] [-w worldspawn_brushes] [-e entities]\n"
+	     "              [-b brushes_per_entity] [-f faces_per_brush]\n"
+	     "              [-p patch_percent] [-g widthxheight] [-k keys]\n"
+	     "              [-c comment_percent] [-d discard_percent]\n"
+	     "              [-P prefix]\n"
+	     "the map is written to the standard output");
+}
+
+static bool read_long(const char *str, long *value)
+{
+	char *end;
+
+	*value = strtol(str, &end, 10);
+	return *end || end == str || *value < 0;
+}
+
+int main(int argc, char **argv)
+{
+	options_t opts = {
+		.seed = 1,
+		.worldspawn_brushes = 1000,
+		.entities = 100,
+		.brushes = 1,
+		.faces = 6,
+		.patches = 5,
+		.patch_width = 3,
+		.patch_height = 3,
+		.keys = 3,
+		.comments = 0,
+		.discards = 0,
+		.prefix = NULL
+	};
+	int i;
+	long n;
+
+	for (i = 1; i < argc; i++) {
+		const char *arg = argv[i + 1];
+		long *value = NULL;
+
+		if (!strcmp(argv[i], "-h")) {
+			print_usage();
+			return 0;
+		}
+
+		if (!arg || argv[i][0] != '-' || strlen(argv[i]) != 2)
+			goto usage;
+
+		switch (argv[i][1]) {
+		case 's':
+			if (read_long(arg, &n))
+				goto usage;
+			opts.seed = n;
+			break;
+		case 'w': value = &opts.worldspawn_brushes; break;
+		case 'e': value = &opts.entities; break;
+		case 'b': value = &opts.brushes; break;
+		case 'f': value = &opts.faces; break;
+		case 'p': value = &opts.patches; break;
+		case 'k': value = &opts.keys; break;
+		case 'c': value = &opts.comments; break;
+		case 'd': value = &opts.discards; break;
+		case 'g':
+			if (sscanf(arg, "%ldx%ld", &opts.patch_width,
+			           &opts.patch_height) != 2 ||
+			    opts.patch_width < 3 || opts.patch_height < 3)
+				goto usage;
+			break;
+		case 'P':
+			opts.prefix = arg;
+			break;
+		default:
+			goto usage;
+		}
+
+		if (value && read_long(arg, value))
+			goto usage;
+
+		i++;
+	}
+
+	// xorshift gets stuck at 0
+	rng_state = opts.seed * 0x9e3779b97f4a7c15ull + 1;
+
+	printf("// entity 0\n{\n\"classname\" \"worldspawn\"\n");
+	if (opts.prefix)
+		printf("\"mapcat_prefix\" \"%s\"\n", opts.prefix);
+	printf("\"message\" \"mapgen seed %llu\"\n",
+	       (unsigned long long)opts.seed);
+	put_brushes(&opts, opts.worldspawn_brushes);
+	printf("}\n");
+
+	for (n = 1; n <= opts.entities; n++)
+		put_entity(&opts, n);
+
+	return ferror(stdout) || fflush(stdout) ? 1 : 0;
+
+usage:
+	print_usage();
+	return 1;
+}
@@ -0,0 +1,427 @@
+/*
+Copyright (C) 2016  Paweł Redman
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 3
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software Foundation,
+Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+*/
+
+// Microbenchmarks of the inner loops: the lexer (lexer_get_token covers
+// token_append), vstr_putn and the number conversions both ways. Every kernel
+// runs a batch of operations at a time. After a few warm-up batches each
+// repetition is timed on its own and the report has the minimum, the median,
+// the mean and the standard deviation of the time per operation, the rate of
+// the median and, on x86, the cycles per operation (from the time stamp
+// counter, so they're reference cycles).
+
+#include "common.h"
+#include <math.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC
+#endif
+
+#define MAX_REPS 1000
+#define TEXT_SIZE (1024 * 1024) // of the lexer's input
+#define NUM_NUMBERS 4096
+#define NUMBER_SIZE 32 // of the strings in numbers and integers
+
+typedef struct {
+	const char *name;
+	size_t (*run)(void); // returns the number of operations done
+} kernel_t;
+
+// results go here, so that the compiler can't drop the work
+static volatile uint64_t sink;
+
+static char *text, *numbers_text;
+static size_t text_size, numbers_size;
+static char numbers[NUM_NUMBERS][NUMBER_SIZE];
+static char integers[NUM_NUMBERS][NUMBER_SIZE];
+static size_t number_lens[NUM_NUMBERS], integer_lens[NUM_NUMBERS];
+static float floats[NUM_NUMBERS];
+
+//
+// inputs
+//
+
+static uint32_t rng_state = 1;
+
+static uint32_t rng(void)
+{
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 17;
+	rng_state ^= rng_state << 5;
+	return rng_state;
+}
+
+static void append(char **buf, size_t *size, const char *str)
+{
+	size_t len = strlen(str);
+
+	memcpy(*buf + *size, str, len);
+	*size += len;
+}
+
+// brush faces, with keys and comments in between, like an editor writes
+static char *make_text(size_t *size)
+{
+	char *buf, line[256];
+
+	buf = malloc(TEXT_SIZE + sizeof(line));
+	if (!buf)
+		return NULL;
+
+	*size = 0;
+	while (*size < TEXT_SIZE) {
+		switch (rng() % 16) {
+		case 0:
+			snprintf(line, sizeof(line), "\"key%u\" \"some value %u\"\n",
+			         rng() % 100, rng());
+			break;
+		case 1:
+			snprintf(line, sizeof(line), "// brush %u\n{\n", rng());
+			break;
+		default:
+			snprintf(line, sizeof(line), "( %d %d %d ) ( %d %d %d ) "
+			         "( %d %d.5 %d ) gothic_wall/iron01_e 0 0 0 0.5 "
+			         "0.5 0 0 0\n", (int)(rng() % 8192) - 4096,
+			         (int)(rng() % 8192) - 4096,
+			         (int)(rng() % 8192) - 4096, (int)(rng() % 64),
+			         (int)(rng() % 64), (int)(rng() % 64),
+			         (int)(rng() % 512), (int)(rng() % 512),
+			         (int)(rng() % 512));
+		}
+
+		append(&buf, size, line);
+	}
+
+	return buf;
+}
+
+// numbers only, like the insides of faces and patches
+static char *make_numbers_text(size_t *size)
+{
+	char *buf, num[64];
+
+	buf = malloc(TEXT_SIZE + sizeof(num));
+	if (!buf)
+		return NULL;
+
+	*size = 0;
+	while (*size < TEXT_SIZE) {
+		if (rng() % 4)
+			snprintf(num, sizeof(num), "%d ",
+			         (int)(rng() % 8192) - 4096);
+		else
+			snprintf(num, sizeof(num), "%d.%03u ",
+			         (int)(rng() % 8192) - 4096, rng() % 1000);
+
+		append(&buf, size, num);
+	}
+
+	return buf;
+}
+
+static int make_inputs(void)
+{
+	size_t i;
+
+	text = make_text(&text_size);
+	numbers_text = make_numbers_text(&numbers_size);
+	if (!text || !numbers_text)
+		return 1;
+
+	for (i = 0; i < NUM_NUMBERS; i++) {
+		if (i % 4)
+			snprintf(numbers[i], NUMBER_SIZE, "%d",
+			         (int)(rng() % 8192) - 4096);
+		else
+			snprintf(numbers[i], NUMBER_SIZE, "%d.%06u",
+			         (int)(rng() % 8192) - 4096, rng() % 1000000);
+
+		number_lens[i] = strlen(numbers[i]);
+
+		snprintf(integers[i], NUMBER_SIZE, "%u", rng() % 64);
+		integer_lens[i] = strlen(integers[i]);
+
+		floats[i] = ((int)(rng() % 8192) - 4096) / 8.0f;
+	}
+
+	return 0;
+}
+
+//
+// kernels
+//
+
+static size_t lex(const char *buf, size_t size, bool floats_only)
+{
+	lexer_state_t ls;
+	lexer_split_t start = {0, 0, 0, false};
+	vstr_t token;
+	size_t ops = 0;
+	float f[8];
+
+	vstr_init(&token);
+	lexer_open_chunk(&ls, "bench", buf, &start, size, &token);
+	ls.quiet = true;
+
+	if (floats_only) {
+		while (!lexer_get_floats(&ls, f, 8)) {
+			sink += f[0] != 0;
+			ops += 8;
+		}
+	} else {
+		while (!lexer_get_token(&ls)) {
+			sink += ls.token_size;
+			ops++;
+		}
+	}
+
+	lexer_close(&ls);
+	vstr_free(&token);
+	return ops;
+}
+
+static size_t run_lexer_get_token(void)
+{
+	return lex(text, text_size, false);
+}
+
+static size_t run_lexer_get_floats(void)
+{
+	return lex(numbers_text, numbers_size, true);
+}
+
+static size_t run_vstr_putn(void)
+{
+	vstr_t vstr;
+	size_t i;
+
+	vstr_init(&vstr);
+	for (i = 0; i + 16 <= TEXT_SIZE; i += 16) {
+		vstr_clear(&vstr);
+		vstr_putn(&vstr, text + i, 4 + (i & 7));
+	}
+
+	sink += vstr.size;
+	vstr_free(&vstr);
+	return TEXT_SIZE / 16;
+}
+
+// what lexer_get_floats does for every number outside the fast paths
+static size_t run_str_to_float(void)
+{
+	size_t i;
+	float sum = 0;
+
+	for (i = 0; i < NUM_NUMBERS; i++)
+		sum += str_to_float(numbers[i], number_lens[i]);
+
+	sink += (uint64_t)sum;
+	return NUM_NUMBERS;
+}
+
+// the above without the fallback to strtof
+static size_t run_parse_float(void)
+{
+	size_t i;
+	float f, sum = 0;
+
+	for (i = 0; i < NUM_NUMBERS; i++)
+		if (!parse_float(numbers[i], number_lens[i], &f))
+			sum += f;
+
+	sink += (uint64_t)sum;
+	return NUM_NUMBERS;
+}
+
+// patch sizes
+static size_t run_str_to_size(void)
+{
+	size_t i, sum = 0;
+
+	for (i = 0; i < NUM_NUMBERS; i++)
+		sum += str_to_size(integers[i], integer_lens[i]);
+
+	sink += sum;
+	return NUM_NUMBERS;
+}
+
+// what write_brush does for every number
+static size_t run_format_float_fixed(void)
+{
+	char buf[FLOAT_BUFFER];
+	size_t i, sum = 0;
+
+	for (i = 0; i < NUM_NUMBERS; i++)
+		sum += format_float_fixed(buf, floats[i], 6);
+
+	sink += sum;
+	return NUM_NUMBERS;
+}
+
+static size_t run_format_float_short(void)
+{
+	char buf[FLOAT_BUFFER];
+	size_t i, sum = 0;
+
+	for (i = 0; i < NUM_NUMBERS; i++)
+		sum += format_float_short(buf, floats[i]);
+
+	sink += sum;
+	return NUM_NUMBERS;
+}
+
+static const kernel_t kernels[] = {
+	{"lexer_get_token", run_lexer_get_token},
+	{"lexer_get_floats", run_lexer_get_floats},
+	{"vstr_putn", run_vstr_putn},
+	{"str_to_float", run_str_to_float},
+	{"parse_float", run_parse_float},
+	{"str_to_size", run_str_to_size},
+	{"format_float_fixed", run_format_float_fixed},
+	{"format_float_short", run_format_float_short}
+};
+
+//
+// harness
+//
+
+typedef struct {
+	double ns; // per operation
+	double cycles; // ditto, 0 if unknown
+} sample_t;
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static uint64_t cycles(void)
+{
+#ifdef HAVE_TSC
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+static int compare_samples(const void *a, const void *b)
+{
+	const sample_t *sa = a, *sb = b;
+
+	return sa->ns < sb->ns ? -1 : sa->ns > sb->ns;
+}
+
+static void run_kernel(const kernel_t *kernel, int warmup, int reps)
+{
+	static sample_t samples[MAX_REPS];
+	double mean = 0, var = 0, median;
+	int i;
+
+	for (i = 0; i < warmup; i++)
+		kernel->run();
+
+	for (i = 0; i < reps; i++) {
+		double start = now_ns();
+		uint64_t start_cycles = cycles();
+		size_t ops;
+
+		ops = kernel->run();
+		samples[i].cycles = (double)(cycles() - start_cycles) / ops;
+		samples[i].ns = (now_ns() - start) / ops;
+		mean += samples[i].ns;
+	}
+
+	mean /= reps;
+	for (i = 0; i < reps; i++)
+		var += (samples[i].ns - mean) * (samples[i].ns - mean);
+	var /= reps;
+
+	qsort(samples, reps, sizeof(sample_t), compare_samples);
+	median = samples[reps / 2].ns;
+
+	printf("%-20s %9.2f %9.2f %9.2f %8.2f %12.0f", kernel->name,
+	       samples[0].ns, median, mean, sqrt(var), 1e9 / median);
+
+	if (samples[reps / 2].cycles)
+		printf(" %9.2f\n", samples[reps / 2].cycles);
+	else
+		printf(" %9s\n", "-");
+}
+
+static void print_usage(void)
+{
+	puts("usage: micro [-w warmup] [-r repetitions] [kernel...]");
+}
+
+int main(int argc, char **argv)
+{
+	int i, warmup = 3, reps = 21;
+	size_t k;
+	bool any = false;
+
+	for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+		if (!strcmp(argv[i], "-w") && i + 1 < argc)
+			warmup = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-r") && i + 1 < argc)
+			reps = atoi(argv[++i]);
+		else {
+			print_usage();
+			return 1;
+		}
+	}
+
+	if (warmup < 0 || reps < 1 || reps > MAX_REPS) {
+		print_usage();
+		return 1;
+	}
+
+	if (make_inputs()) {
+		fprintf(stderr, "error: out of memory\n");
+		return 1;
+	}
+
+	printf("%-20s %9s %9s %9s %8s %12s %9s\n", "kernel", "min ns",
+	       "median ns", "mean ns", "stddev", "op/s", "cycles");
+
+	// the kernels given on the command line, or all of them
+	for (k = 0; k < sizeof(kernels) / sizeof(*kernels); k++) {
+		bool wanted = (i == argc);
+		int j;
+
+		for (j = i; j < argc; j++)
+			if (!strcmp(argv[j], kernels[k].name))
+				wanted = true;
+
+		if (!wanted)
+			continue;
+
+		run_kernel(kernels + k, warmup, reps);
+		any = true;
+	}
+
+	if (!any) {
+		fprintf(stderr, "error: no such kernel\n");
+		return 1;
+	}
+
+	return 0;
+}
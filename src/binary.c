@@ -0,0 +1,940 @@
+/*
+Copyright (C) 2016  Paweł Redman
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 3
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software Foundation,
+Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+*/
+
+// The binary (compiled) map format is a header followed by flat sections of
+// fixed-size records that refer to each other by index. Loading one maps the
+// file and builds the map tree around it: face and patch numbers are used
+// from the mapping in place and only the interned strings (shaders, keys and
+// classnames, each stored once in the names section) have to be looked up.
+//
+// Unless MAPCAT_REFORMAT is set, the input text of the brushes and entities
+// that have it (see copy_verbatim) is stored as well, so a map written as
+// text from a binary one comes out the same as from the original input.
+//
+// Everything is stored in the byte order of the machine that wrote it and
+// files with a different byte order or version are rejected.
+
+#include "common.h"
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define BINARY_MAGIC "MAPCATB" // with the terminator
+#define BINARY_VERSION 2
+#define BINARY_BYTE_ORDER 0x01020304
+#define BINARY_ALIGN 8
+
+#define BINARY_NONE UINT32_MAX
+
+enum {
+	SECTION_NAMES, // NUL-terminated, interned when loading
+	SECTION_VALUES, // NUL-terminated, used in place
+	SECTION_ENTITIES,
+	SECTION_KEYS,
+	SECTION_BRUSHES,
+	SECTION_FACE_DEFS,
+	SECTION_FACE_SHADERS,
+	SECTION_FACE_TEXMAPS,
+	SECTION_PATCHES,
+	SECTION_PATCH_POINTS,
+	SECTION_SOURCES, // the input text of brushes and entities
+	NUM_SECTIONS
+};
+
+typedef struct {
+	uint64_t offs, size; // in bytes
+	uint64_t count; // of records (or strings)
+} binary_section_t;
+
+// the first entity is the worldspawn
+#define BINARY_HAS_WORLDSPAWN 0x01
+
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+	uint32_t flags;
+	uint32_t pad;
+
+	// map_t's counters
+	uint64_t num_entities, num_discarded_entities;
+	uint64_t num_brushes, num_discarded_brushes;
+	uint64_t num_patches, num_discarded_patches;
+
+	binary_section_t sections[NUM_SECTIONS];
+} binary_header_t;
+
+typedef struct {
+	uint32_t classname; // BINARY_NONE if there's none
+	uint32_t first_key, num_keys;
+	uint32_t first_brush, num_brushes;
+	uint32_t src, src_len; // in the sources section, src_len is 0 if none
+} binary_entity_t;
+
+typedef struct {
+	uint32_t key; // index of the name
+	uint32_t value; // offset in the values section
+} binary_key_t;
+
+typedef struct {
+	uint32_t first_face, num_faces;
+	uint32_t patch; // BINARY_NONE if it's not a patch
+	uint32_t src, src_len; // in the sources section, src_len is 0 if none
+} binary_brush_t;
+
+typedef struct {
+	uint32_t xres, yres;
+	uint32_t shader;
+	uint32_t first_point;
+} binary_patch_t;
+
+static const size_t record_sizes[NUM_SECTIONS] = {
+	[SECTION_NAMES] = 0,
+	[SECTION_VALUES] = 0,
+	[SECTION_ENTITIES] = sizeof(binary_entity_t),
+	[SECTION_KEYS] = sizeof(binary_key_t),
+	[SECTION_BRUSHES] = sizeof(binary_brush_t),
+	[SECTION_FACE_DEFS] = 9 * sizeof(float),
+	[SECTION_FACE_SHADERS] = sizeof(uint32_t),
+	[SECTION_FACE_TEXMAPS] = 8 * sizeof(float),
+	[SECTION_PATCHES] = sizeof(binary_patch_t),
+	[SECTION_PATCH_POINTS] = 5 * sizeof(float),
+	[SECTION_SOURCES] = 0
+};
+
+//
+// writing
+//
+
+// names are interned, so they're told apart by their pointers
+typedef struct {
+	const char **slots; // open addressing, linear probing
+	uint32_t *indices;
+	size_t size, count; // size is a power of two
+} name_table_t;
+
+static void name_table_free(name_table_t *table)
+{
+	free(table->slots);
+	free(table->indices);
+	memset(table, 0, sizeof(*table));
+}
+
+static size_t name_slot(const name_table_t *table, const char *name)
+{
+	size_t i;
+
+	i = ((uintptr_t)name >> 4) * 0x9e3779b97f4a7c15ull;
+	for (i &= table->size - 1; table->slots[i] && table->slots[i] != name;
+	     i = (i + 1) & (table->size - 1))
+		;
+
+	return i;
+}
+
+//RETURN VALUE
+//	the index of name, BINARY_NONE if out of memory
+static uint32_t name_add(name_table_t *table, const char *name)
+{
+	size_t i;
+
+	if (table->count * 2 >= table->size) {
+		name_table_t bigger = *table;
+		size_t j;
+
+		bigger.size = table->size ? table->size * 2 : 256;
+		bigger.slots = calloc(bigger.size, sizeof(const char*));
+		bigger.indices = calloc(bigger.size, sizeof(uint32_t));
+		if (!bigger.slots || !bigger.indices) {
+			name_table_free(&bigger);
+			return BINARY_NONE;
+		}
+
+		for (j = 0; j < table->size; j++) {
+			if (!table->slots[j])
+				continue;
+
+			i = name_slot(&bigger, table->slots[j]);
+			bigger.slots[i] = table->slots[j];
+			bigger.indices[i] = table->indices[j];
+		}
+
+		name_table_free(table);
+		*table = bigger;
+	}
+
+	i = name_slot(table, name);
+	if (!table->slots[i]) {
+		table->slots[i] = name;
+		table->indices[i] = table->count++;
+	}
+
+	return table->indices[i];
+}
+
+typedef struct {
+	FILE *fp;
+	uint64_t offs;
+	name_table_t names;
+	binary_header_t header;
+	bool keep_sources;
+	uint64_t sources; // the size of the sources section so far
+	bool oom;
+} writer_t;
+
+static void put(writer_t *w, const void *data, size_t size)
+{
+	fwrite(data, 1, size, w->fp);
+	w->offs += size;
+}
+
+static uint32_t name_index(writer_t *w, const char *name)
+{
+	uint32_t index;
+
+	index = name_add(&w->names, name);
+	if (index == BINARY_NONE)
+		w->oom = true;
+
+	return index;
+}
+
+// reserves room for src in the sources section
+static void add_source(writer_t *w, const char *src, size_t len,
+                       uint32_t *offs, uint32_t *offs_len)
+{
+	if (!w->keep_sources || !src)
+		return;
+
+	if (w->sources + len > UINT32_MAX) {
+		w->oom = true;
+		return;
+	}
+
+	*offs = w->sources;
+	*offs_len = len;
+	w->sources += len;
+}
+
+// whether the source of the entity is stored, see copy_verbatim
+static bool entity_source(const writer_t *w, const map_t *map,
+                          const entity_t *entity)
+{
+	// the worldspawn's brushes are merged, so it can't be copied
+	return w->keep_sources && entity->src && !entity->modified &&
+	       entity != map->worldspawn;
+}
+
+static void begin_section(writer_t *w, int section)
+{
+	static const char zeros[BINARY_ALIGN];
+
+	put(w, zeros, -w->offs & (BINARY_ALIGN - 1));
+	w->header.sections[section].offs = w->offs;
+}
+
+static void end_section(writer_t *w, int section)
+{
+	binary_section_t *sec = w->header.sections + section;
+
+	sec->size = w->offs - sec->offs;
+	if (record_sizes[section])
+		sec->count = sec->size / record_sizes[section];
+}
+
+// iterates over the worldspawn (if any) and then every other entity
+#define for_each_entity(map, entity) \
+	for ((entity) = (map)->worldspawn ? (map)->worldspawn : \
+	                (map)->entities; \
+	     (entity); \
+	     (entity) = ((entity) == (map)->worldspawn ? (map)->entities : \
+	                 elist_cnext((entity), list)))
+
+static void write_entities(writer_t *w, const map_t *map)
+{
+	const entity_t *entity;
+	const entity_key_t *key;
+	const brush_t *brush;
+	uint32_t num_keys = 0, num_brushes = 0;
+
+	begin_section(w, SECTION_ENTITIES);
+
+	for_each_entity(map, entity) {
+		binary_entity_t rec;
+
+		memset(&rec, 0, sizeof(rec));
+		rec.classname = entity->classname ?
+		                name_index(w, entity->classname) : BINARY_NONE;
+
+		rec.first_key = num_keys;
+		elist_cfor(key, entity->keys, list)
+			rec.num_keys++;
+
+		rec.first_brush = num_brushes;
+		elist_cfor(brush, entity->brushes, list)
+			rec.num_brushes++;
+
+		if (entity_source(w, map, entity))
+			add_source(w, entity->src, entity->src_len, &rec.src,
+			           &rec.src_len);
+
+		put(w, &rec, sizeof(rec));
+		num_keys += rec.num_keys;
+		num_brushes += rec.num_brushes;
+	}
+
+	end_section(w, SECTION_ENTITIES);
+}
+
+static void write_keys(writer_t *w, const map_t *map)
+{
+	const entity_t *entity;
+	const entity_key_t *key;
+	uint64_t value = 0;
+
+	begin_section(w, SECTION_KEYS);
+
+	for_each_entity(map, entity)
+	elist_cfor(key, entity->keys, list) {
+		binary_key_t rec;
+
+		rec.key = name_index(w, key->key);
+		rec.value = value;
+		put(w, &rec, sizeof(rec));
+
+		// prefixes are stored as a part of the value
+		if (key->prefix)
+			value += strlen(key->prefix);
+		value += strlen(key->value) + 1;
+	}
+
+	end_section(w, SECTION_KEYS);
+
+	if (value > UINT32_MAX)
+		w->oom = true;
+
+	begin_section(w, SECTION_VALUES);
+
+	for_each_entity(map, entity)
+	elist_cfor(key, entity->keys, list) {
+		if (key->prefix)
+			put(w, key->prefix, strlen(key->prefix));
+		put(w, key->value, strlen(key->value) + 1);
+	}
+
+	end_section(w, SECTION_VALUES);
+}
+
+static void write_brushes(writer_t *w, const map_t *map)
+{
+	const entity_t *entity;
+	const brush_t *brush;
+	uint32_t num_faces = 0, num_patches = 0;
+	uint64_t entity_src, next_entity_src = 0;
+
+	begin_section(w, SECTION_BRUSHES);
+
+	for_each_entity(map, entity) {
+	bool in_entity = entity_source(w, map, entity);
+
+	// the entity sources come first, in the same order
+	entity_src = next_entity_src;
+	if (in_entity)
+		next_entity_src += entity->src_len;
+
+	elist_cfor(brush, entity->brushes, list) {
+		binary_brush_t rec;
+
+		memset(&rec, 0, sizeof(rec));
+		if (brush->patch) {
+			rec.patch = num_patches++;
+		} else {
+			rec.patch = BINARY_NONE;
+			rec.first_face = num_faces;
+			rec.num_faces = brush->num_faces;
+			num_faces += brush->num_faces;
+		}
+
+		// brushes of an entity that's stored whole point into it
+		if (in_entity && !w->oom) {
+			rec.src = entity_src + (brush->src - entity->src);
+			rec.src_len = brush->src_len;
+		} else
+			add_source(w, brush->src, brush->src_len, &rec.src,
+			           &rec.src_len);
+
+		put(w, &rec, sizeof(rec));
+	}
+	}
+
+	end_section(w, SECTION_BRUSHES);
+}
+
+// writes a single array of every face, one section at a time
+static void write_faces(writer_t *w, const map_t *map, int section)
+{
+	const entity_t *entity;
+	const brush_t *brush;
+
+	begin_section(w, section);
+
+	for_each_entity(map, entity)
+	elist_cfor(brush, entity->brushes, list) {
+		const face_block_t *block = brush->block;
+		size_t i, first = brush->first_face;
+
+		if (brush->patch)
+			continue;
+
+		switch (section) {
+		case SECTION_FACE_DEFS:
+			put(w, block->def + first,
+			    brush->num_faces * sizeof(block->def[0]));
+			break;
+
+		case SECTION_FACE_TEXMAPS:
+			put(w, block->texmap + first,
+			    brush->num_faces * sizeof(block->texmap[0]));
+			break;
+
+		case SECTION_FACE_SHADERS:
+			for (i = 0; i < brush->num_faces; i++) {
+				uint32_t index;
+
+				index = name_index(w, block->shader[first + i]);
+				put(w, &index, sizeof(index));
+			}
+			break;
+		}
+	}
+
+	end_section(w, section);
+}
+
+static void write_patches(writer_t *w, const map_t *map)
+{
+	const entity_t *entity;
+	const brush_t *brush;
+	uint64_t num_points = 0;
+
+	begin_section(w, SECTION_PATCHES);
+
+	for_each_entity(map, entity)
+	elist_cfor(brush, entity->brushes, list) {
+		binary_patch_t rec;
+
+		if (!brush->patch)
+			continue;
+
+		memset(&rec, 0, sizeof(rec));
+		rec.xres = brush->patch->xres;
+		rec.yres = brush->patch->yres;
+		rec.shader = name_index(w, brush->patch->shader);
+		rec.first_point = num_points;
+		put(w, &rec, sizeof(rec));
+
+		num_points += brush->patch->xres * brush->patch->yres;
+	}
+
+	end_section(w, SECTION_PATCHES);
+
+	if (num_points > UINT32_MAX)
+		w->oom = true;
+
+	begin_section(w, SECTION_PATCH_POINTS);
+
+	for_each_entity(map, entity)
+	elist_cfor(brush, entity->brushes, list)
+		if (brush->patch)
+			put(w, brush->patch->def, brush->patch->xres *
+			    brush->patch->yres * 5 * sizeof(float));
+
+	end_section(w, SECTION_PATCH_POINTS);
+}
+
+// in the same order as add_source was called in
+static void write_sources(writer_t *w, const map_t *map)
+{
+	const entity_t *entity;
+	const brush_t *brush;
+
+	begin_section(w, SECTION_SOURCES);
+
+	if (w->keep_sources) {
+		for_each_entity(map, entity)
+			if (entity_source(w, map, entity))
+				put(w, entity->src, entity->src_len);
+
+		for_each_entity(map, entity)
+			if (!entity_source(w, map, entity))
+				elist_cfor(brush, entity->brushes, list)
+					if (brush->src)
+						put(w, brush->src,
+						    brush->src_len);
+	}
+
+	end_section(w, SECTION_SOURCES);
+}
+
+// the names section goes last, once all the names are known
+static void write_names(writer_t *w)
+{
+	const char **names;
+	size_t i;
+
+	names = calloc(w->names.count + 1, sizeof(const char*));
+	if (!names) {
+		w->oom = true;
+		return;
+	}
+
+	for (i = 0; i < w->names.size; i++)
+		if (w->names.slots[i])
+			names[w->names.indices[i]] = w->names.slots[i];
+
+	begin_section(w, SECTION_NAMES);
+
+	for (i = 0; i < w->names.count; i++)
+		put(w, names[i], strlen(names[i]) + 1);
+
+	end_section(w, SECTION_NAMES);
+	w->header.sections[SECTION_NAMES].count = w->names.count;
+
+	free(names);
+}
+
+int map_write_binary(const map_t *map, const char *path, int flags)
+{
+	int rv = 1;
+	writer_t w;
+	binary_header_t *h = &w.header;
+
+	memset(&w, 0, sizeof(w));
+	w.keep_sources = !(flags & MAPCAT_REFORMAT);
+
+	w.fp = fopen(path, "wb");
+	if (!w.fp) {
+		perror(path);
+		return 1;
+	}
+
+	// the header is written again at the end, once it's filled in
+	put(&w, h, sizeof(*h));
+
+	write_entities(&w, map);
+	write_keys(&w, map);
+	write_brushes(&w, map);
+	write_faces(&w, map, SECTION_FACE_DEFS);
+	write_faces(&w, map, SECTION_FACE_SHADERS);
+	write_faces(&w, map, SECTION_FACE_TEXMAPS);
+	write_patches(&w, map);
+	write_sources(&w, map);
+	write_names(&w);
+
+	if (w.oom) {
+		fprintf(stderr, "error: out of memory or the map is too "
+		                "big for the binary format\n");
+		goto out;
+	}
+
+	memcpy(h->magic, BINARY_MAGIC, sizeof(h->magic));
+	h->version = BINARY_VERSION;
+	h->byte_order = BINARY_BYTE_ORDER;
+	h->flags = map->worldspawn ? BINARY_HAS_WORLDSPAWN : 0;
+	h->num_entities = map->num_entities;
+	h->num_discarded_entities = map->num_discarded_entities;
+	h->num_brushes = map->num_brushes;
+	h->num_discarded_brushes = map->num_discarded_brushes;
+	h->num_patches = map->num_patches;
+	h->num_discarded_patches = map->num_discarded_patches;
+
+	rewind(w.fp);
+	fwrite(h, 1, sizeof(*h), w.fp);
+
+	if (ferror(w.fp)) {
+		perror(path);
+		goto out;
+	}
+
+	rv = 0;
+out:
+	if (fclose(w.fp) && !rv) {
+		perror(path);
+		rv = 1;
+	}
+
+	name_table_free(&w.names);
+	return rv;
+}
+
+//
+// reading
+//
+
+typedef struct {
+	const char *data;
+	size_t size;
+	const binary_header_t *header;
+
+	const char **names;
+	face_block_t *block;
+	brush_patch_t *patches;
+	brush_t *brushes;
+} reader_t;
+
+//RETURN VALUE
+//	the text of a brush or entity, NULL if there's none or it's corrupt
+static const char *source(const reader_t *r, uint32_t offs, uint32_t len)
+{
+	const binary_section_t *sec = r->header->sections + SECTION_SOURCES;
+
+	if (!len || offs > sec->size || len > sec->size - offs)
+		return NULL;
+
+	return r->data + sec->offs + offs;
+}
+
+static const void *section(const reader_t *r, int section)
+{
+	return r->data + r->header->sections[section].offs;
+}
+
+static uint64_t count(const reader_t *r, int section)
+{
+	return r->header->sections[section].count;
+}
+
+static int check_header(const reader_t *r)
+{
+	const binary_header_t *h = r->header;
+	int i;
+
+	if (h->version != BINARY_VERSION ||
+	    h->byte_order != BINARY_BYTE_ORDER)
+		return 1;
+
+	for (i = 0; i < NUM_SECTIONS; i++) {
+		const binary_section_t *sec = h->sections + i;
+
+		if (sec->offs % BINARY_ALIGN || sec->offs > r->size ||
+		    sec->size > r->size - sec->offs)
+			return 1;
+
+		if (record_sizes[i] && sec->size != sec->count * record_sizes[i])
+			return 1;
+	}
+
+	if (count(r, SECTION_FACE_SHADERS) != count(r, SECTION_FACE_DEFS) ||
+	    count(r, SECTION_FACE_TEXMAPS) != count(r, SECTION_FACE_DEFS))
+		return 1;
+
+	// every value has to be terminated
+	if (h->sections[SECTION_VALUES].size &&
+	    ((const char*)section(r, SECTION_VALUES))
+	    [h->sections[SECTION_VALUES].size - 1])
+		return 1;
+
+	if ((h->flags & BINARY_HAS_WORLDSPAWN) &&
+	    !count(r, SECTION_ENTITIES))
+		return 1;
+
+	return 0;
+}
+
+//RETURN VALUES
+//	0 on success
+//	1 if out of memory
+//	2 if the file is corrupt
+static int read_names(reader_t *r, map_t *map)
+{
+	const char *p, *e;
+	uint64_t i, num_names = count(r, SECTION_NAMES);
+
+	p = section(r, SECTION_NAMES);
+	e = p + r->header->sections[SECTION_NAMES].size;
+
+	if (num_names > r->header->sections[SECTION_NAMES].size)
+		return 2;
+
+	r->names = arena_alloc(&map->arena, num_names * sizeof(const char*));
+	if (!r->names)
+		return 1;
+
+	for (i = 0; i < num_names; i++) {
+		size_t len = strnlen(p, e - p);
+
+		if (p + len == e)
+			return 2;
+
+		r->names[i] = intern(p, len);
+		if (!r->names[i])
+			return 1;
+
+		p += len + 1;
+	}
+
+	return 0;
+}
+
+static const char *name(const reader_t *r, uint32_t index)
+{
+	if (index >= count(r, SECTION_NAMES))
+		return NULL;
+
+	return r->names[index];
+}
+
+// faces and patches are used from the mapping in place
+static int read_faces(reader_t *r, map_t *map)
+{
+	const uint32_t *shaders = section(r, SECTION_FACE_SHADERS);
+	uint64_t i, num_faces = count(r, SECTION_FACE_DEFS);
+	const binary_patch_t *recs = section(r, SECTION_PATCHES);
+	uint64_t num_patches = count(r, SECTION_PATCHES);
+	uint64_t num_points = count(r, SECTION_PATCH_POINTS);
+	float *points = (float*)section(r, SECTION_PATCH_POINTS);
+
+	r->block = arena_alloc(&map->arena, sizeof(face_block_t));
+	if (!r->block)
+		return 1;
+
+	r->block->def = (float(*)[9])section(r, SECTION_FACE_DEFS);
+	r->block->texmap = (float(*)[8])section(r, SECTION_FACE_TEXMAPS);
+	r->block->count = r->block->alloc = num_faces;
+	r->block->shader = arena_alloc(&map->arena,
+	                               num_faces * sizeof(const char*));
+	if (!r->block->shader)
+		return 1;
+
+	for (i = 0; i < num_faces; i++)
+		if (!(r->block->shader[i] = name(r, shaders[i])))
+			return 2;
+
+	r->patches = arena_alloc(&map->arena,
+	                         num_patches * sizeof(brush_patch_t));
+	if (!r->patches)
+		return 1;
+
+	for (i = 0; i < num_patches; i++) {
+		brush_patch_t *patch = r->patches + i;
+
+		patch->xres = recs[i].xres;
+		patch->yres = recs[i].yres;
+		patch->shader = name(r, recs[i].shader);
+		if (!patch->shader || recs[i].first_point > num_points ||
+		    (uint64_t)patch->xres * patch->yres >
+		    num_points - recs[i].first_point)
+			return 2;
+
+		patch->def = points + (size_t)recs[i].first_point * 5;
+	}
+
+	return 0;
+}
+
+static int read_brushes(reader_t *r, map_t *map)
+{
+	const binary_brush_t *recs = section(r, SECTION_BRUSHES);
+	uint64_t i, num_brushes = count(r, SECTION_BRUSHES);
+	uint64_t num_faces = count(r, SECTION_FACE_DEFS);
+
+	r->brushes = arena_alloc(&map->arena, num_brushes * sizeof(brush_t));
+	if (!r->brushes)
+		return 1;
+
+	memset(r->brushes, 0, num_brushes * sizeof(brush_t));
+
+	for (i = 0; i < num_brushes; i++) {
+		brush_t *brush = r->brushes + i;
+
+		brush->src = source(r, recs[i].src, recs[i].src_len);
+		brush->src_len = recs[i].src_len;
+
+		if (recs[i].patch != BINARY_NONE) {
+			if (recs[i].patch >= count(r, SECTION_PATCHES))
+				return 2;
+
+			brush->patch = r->patches + recs[i].patch;
+			continue;
+		}
+
+		if (recs[i].first_face > num_faces ||
+		    recs[i].num_faces > num_faces - recs[i].first_face)
+			return 2;
+
+		brush->block = r->block;
+		brush->first_face = recs[i].first_face;
+		brush->num_faces = recs[i].num_faces;
+	}
+
+	return 0;
+}
+
+static int read_entities(reader_t *r, map_t *map)
+{
+	const binary_entity_t *recs = section(r, SECTION_ENTITIES);
+	const binary_key_t *key_recs = section(r, SECTION_KEYS);
+	const char *values = section(r, SECTION_VALUES);
+	uint64_t i, j, num_entities = count(r, SECTION_ENTITIES);
+	uint64_t next_key = 0, next_brush = 0;
+	entity_t *entities;
+	entity_key_t *keys;
+
+	entities = arena_alloc(&map->arena, num_entities * sizeof(entity_t));
+	keys = arena_alloc(&map->arena,
+	                   count(r, SECTION_KEYS) * sizeof(entity_key_t));
+	if (!entities || !keys)
+		return 1;
+
+	memset(entities, 0, num_entities * sizeof(entity_t));
+
+	for (i = 0; i < num_entities; i++) {
+		entity_t *entity = entities + i;
+
+		// keys and brushes are stored in order, so every record
+		// begins where the previous one ended
+		if (recs[i].first_key != next_key ||
+		    recs[i].num_keys > count(r, SECTION_KEYS) - next_key ||
+		    recs[i].first_brush != next_brush ||
+		    recs[i].num_brushes > count(r, SECTION_BRUSHES) -
+		                          next_brush)
+			return 2;
+
+		if (recs[i].classname != BINARY_NONE &&
+		    !(entity->classname = name(r, recs[i].classname)))
+			return 2;
+
+		entity->src = source(r, recs[i].src, recs[i].src_len);
+		entity->src_len = recs[i].src_len;
+
+		for (j = 0; j < recs[i].num_keys; j++, next_key++) {
+			entity_key_t *key = keys + next_key;
+
+			key->key = name(r, key_recs[next_key].key);
+			if (!key->key || key_recs[next_key].value >=
+			    r->header->sections[SECTION_VALUES].size)
+				return 2;
+
+			key->value = (char*)values + key_recs[next_key].value;
+			elist_append(&entity->keys, key, list);
+		}
+
+		for (j = 0; j < recs[i].num_brushes; j++, next_brush++)
+			elist_append(&entity->brushes,
+			             r->brushes + next_brush, list);
+
+		if (!i && (r->header->flags & BINARY_HAS_WORLDSPAWN))
+			map->worldspawn = entity;
+		else
+			elist_append(&map->entities, entity, list);
+	}
+
+	return 0;
+}
+
+//RETURN VALUES
+//	0 on success
+//	1 on error
+//	-1 if path isn't a binary map (it should be read as text)
+int map_read_binary(map_t *map, const char *path)
+{
+	int fd, ret;
+	struct stat st;
+	char magic[sizeof(BINARY_MAGIC)];
+	void *data;
+	map_source_t *source;
+	reader_t r;
+	const binary_header_t *h;
+
+	// errors are left to be reported by the text reader
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode) ||
+	    pread(fd, magic, sizeof(magic), 0) != sizeof(magic) ||
+	    memcmp(magic, BINARY_MAGIC, sizeof(magic))) {
+		close(fd);
+		return -1;
+	}
+
+	if (st.st_size < (off_t)sizeof(binary_header_t)) {
+		fprintf(stderr, "%s: corrupt binary map\n", path);
+		close(fd);
+		return 1;
+	}
+
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		perror(path);
+		return 1;
+	}
+
+	// the mapping is unmapped by map_free from now on
+	source = arena_alloc(&map->arena, sizeof(map_source_t));
+	if (!source) {
+		munmap(data, st.st_size);
+		goto error_oom;
+	}
+
+	memset(source, 0, sizeof(*source));
+	source->data = data;
+	source->size = st.st_size;
+	source->dev = st.st_dev;
+	source->ino = st.st_ino;
+	elist_append(&map->sources, source, list);
+
+	memset(&r, 0, sizeof(r));
+	r.data = data;
+	r.size = st.st_size;
+	r.header = h = (const binary_header_t*)data;
+
+	if (check_header(&r)) {
+		fprintf(stderr, "%s: unsupported version or corrupt binary "
+		                "map\n", path);
+		goto error;
+	}
+
+	if ((ret = read_names(&r, map)) ||
+	    (ret = read_faces(&r, map)) ||
+	    (ret = read_brushes(&r, map)) ||
+	    (ret = read_entities(&r, map))) {
+		if (ret == 1)
+			goto error_oom;
+
+		fprintf(stderr, "%s: corrupt binary map\n", path);
+		goto error;
+	}
+
+	map->num_entities = h->num_entities;
+	map->num_discarded_entities = h->num_discarded_entities;
+	map->num_brushes = h->num_brushes;
+	map->num_discarded_brushes = h->num_discarded_brushes;
+	map->num_patches = h->num_patches;
+	map->num_discarded_patches = h->num_discarded_patches;
+	return 0;
+
+error_oom:
+	fprintf(stderr, "error: out of memory\n");
+error:
+	map_free(map);
+	return 1;
+}
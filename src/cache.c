@@ -0,0 +1,296 @@
+/*
+Copyright (C) 2016  Paweł Redman
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 3
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software Foundation,
+Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+*/
+
+// The cache is a directory of binary maps (see binary.c), each one being a
+// read and postprocessed input. They're named after a hash of the input's
+// contents, mapcat's version and the options that affect what's stored, so
+// an entry never has to be invalidated: a changed input simply gets a new
+// one.
+//
+// Several processes can share the directory. Entries are written to
+// temporary files and renamed into place, so nobody ever sees a partial
+// one, and an entry that's removed (or replaced) while it's being read
+// stays mapped until it's no longer used. Entries are touched whenever
+// they're used and cache_trim removes the least recently used ones.
+
+#include "common.h"
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define CACHE_SUFFIX ".mapb"
+#define CACHE_TEMP_PREFIX "tmp-"
+#define CACHE_TEMP_MAX_AGE (24 * 60 * 60) // of leftovers from crashed runs
+
+typedef struct {
+	uint64_t a, b;
+} hash_t;
+
+static uint64_t mix(uint64_t x)
+{
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdull;
+	x ^= x >> 33;
+	x *= 0xc4ceb9fe1a85ec53ull;
+	x ^= x >> 33;
+	return x;
+}
+
+// two independent 64-bit lanes, a word at a time
+static void hash_update(hash_t *hash, const char *data, size_t size)
+{
+	size_t i;
+	uint64_t word;
+
+	for (i = 0; i + 8 <= size; i += 8) {
+		memcpy(&word, data + i, 8);
+		hash->a = (hash->a ^ word) * 0x9e3779b97f4a7c15ull;
+		hash->a ^= hash->a >> 29;
+		hash->b = (hash->b + word) * 0xbf58476d1ce4e5b9ull;
+		hash->b ^= hash->b >> 31;
+	}
+
+	word = 0;
+	memcpy(&word, data + i, size - i);
+	hash->a = mix(hash->a ^ word ^ size);
+	hash->b = mix(hash->b + word + size);
+}
+
+void cache_init(cache_t *cache, const char *dir, int flags)
+{
+	hash_t hash = {0x243f6a8885a308d3ull, 0x13198a2e03707344ull};
+	char options[64];
+
+	// the directory is created on the first use, any problems with it are
+	// reported when an entry is stored
+	mkdir(dir, 0777);
+
+	memset(cache, 0, sizeof(*cache));
+	cache->dir = dir;
+	cache->max_size = CACHE_DEFAULT_SIZE;
+	cache->flags = flags & MAPCAT_REFORMAT; // see map_write_binary
+
+	snprintf(options, sizeof(options), PROGRAM_NAME " " PROGRAM_VERSION
+	         " %d", cache->flags);
+	hash_update(&hash, options, strlen(options));
+	cache->seed[0] = hash.a;
+	cache->seed[1] = hash.b;
+}
+
+//RETURN VALUE
+//	the path of the entry for the input at path (to be freed by the
+//	caller), NULL if it can't be cached (it's not a regular file, etc.)
+char *cache_entry(const cache_t *cache, const char *path)
+{
+	int fd;
+	struct stat st;
+	void *data = NULL;
+	hash_t hash = {cache->seed[0], cache->seed[1]};
+	char *entry;
+	size_t len;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode)) {
+		close(fd);
+		return NULL;
+	}
+
+	if (st.st_size) {
+		data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data == MAP_FAILED) {
+			close(fd);
+			return NULL;
+		}
+
+		madvise(data, st.st_size, MADV_SEQUENTIAL);
+		hash_update(&hash, data, st.st_size);
+		munmap(data, st.st_size);
+	}
+
+	close(fd);
+
+	len = strlen(cache->dir) + 1 + 32 + sizeof(CACHE_SUFFIX);
+	entry = malloc(len);
+	if (!entry)
+		return NULL;
+
+	snprintf(entry, len, "%s/%016llx%016llx" CACHE_SUFFIX, cache->dir,
+	         (unsigned long long)hash.a, (unsigned long long)hash.b);
+	return entry;
+}
+
+//RETURN VALUES
+//	0 if the entry exists (it can be read like any other input)
+//	1 if it doesn't
+int cache_lookup(const char *entry)
+{
+	if (access(entry, R_OK))
+		return 1;
+
+	// the entries' times are what cache_trim goes by
+	utimensat(AT_FDCWD, entry, NULL, 0);
+	return 0;
+}
+
+int cache_store(const cache_t *cache, const map_t *map, const char *entry)
+{
+	char *temp;
+	size_t len;
+	const char *name;
+	static unsigned counter;
+	unsigned n;
+
+	// the temporary file is in the same directory, so that the rename is
+	// atomic
+	name = strrchr(entry, '/');
+	len = strlen(entry) + 64;
+	temp = malloc(len);
+	if (!temp) {
+		fprintf(stderr, "error: out of memory\n");
+		return 1;
+	}
+
+	n = __atomic_fetch_add(&counter, 1, __ATOMIC_RELAXED);
+	snprintf(temp, len, "%.*s/" CACHE_TEMP_PREFIX "%ld-%u-%s",
+	         (int)(name - entry), entry, (long)getpid(), n, name + 1);
+
+	if (map_write_binary(map, temp, cache->flags)) {
+		unlink(temp);
+		free(temp);
+		return 1;
+	}
+
+	if (rename(temp, entry)) {
+		perror(entry);
+		unlink(temp);
+		free(temp);
+		return 1;
+	}
+
+	free(temp);
+	return 0;
+}
+
+typedef struct {
+	char *name;
+	off_t size;
+	time_t mtime;
+} trim_entry_t;
+
+static int compare_mtimes(const void *a, const void *b)
+{
+	const trim_entry_t *ea = a, *eb = b;
+
+	if (ea->mtime != eb->mtime)
+		return ea->mtime < eb->mtime ? -1 : 1;
+
+	return 0;
+}
+
+static bool has_suffix(const char *name, const char *suffix)
+{
+	size_t len = strlen(name), suffix_len = strlen(suffix);
+
+	return len > suffix_len && !strcmp(name + len - suffix_len, suffix);
+}
+
+// removes the least recently used entries until the cache fits in
+// cache->max_size
+// note: other processes might be trimming the cache at the same time, so
+// entries can disappear at any point
+int cache_trim(const cache_t *cache)
+{
+	int rv = 1;
+	DIR *dir;
+	struct dirent *ent;
+	trim_entry_t *entries = NULL;
+	size_t count = 0, alloc = 0, i;
+	uint64_t total = 0;
+	time_t now = time(NULL);
+
+	dir = opendir(cache->dir);
+	if (!dir) {
+		perror(cache->dir);
+		return 1;
+	}
+
+	while ((ent = readdir(dir))) {
+		struct stat st;
+
+		if (fstatat(dirfd(dir), ent->d_name, &st, 0) ||
+		    !S_ISREG(st.st_mode))
+			continue;
+
+		if (!strncmp(ent->d_name, CACHE_TEMP_PREFIX,
+		             strlen(CACHE_TEMP_PREFIX))) {
+			if (now - st.st_mtime > CACHE_TEMP_MAX_AGE)
+				unlinkat(dirfd(dir), ent->d_name, 0);
+			continue;
+		}
+
+		if (!has_suffix(ent->d_name, CACHE_SUFFIX))
+			continue;
+
+		if (count == alloc) {
+			trim_entry_t *new;
+
+			alloc = alloc ? alloc * 2 : 256;
+			new = realloc(entries, alloc * sizeof(trim_entry_t));
+			if (!new)
+				goto error_oom;
+
+			entries = new;
+		}
+
+		entries[count].name = strdup(ent->d_name);
+		if (!entries[count].name)
+			goto error_oom;
+
+		entries[count].size = st.st_size;
+		entries[count].mtime = st.st_mtime;
+		total += st.st_size;
+		count++;
+	}
+
+	qsort(entries, count, sizeof(trim_entry_t), compare_mtimes);
+
+	for (i = 0; i < count && total > cache->max_size; i++)
+		if (!unlinkat(dirfd(dir), entries[i].name, 0) ||
+		    errno == ENOENT)
+			total -= entries[i].size;
+
+	rv = 0;
+	goto out;
+
+error_oom:
+	fprintf(stderr, "error: out of memory\n");
+out:
+	for (i = 0; i < count; i++)
+		free(entries[i].name);
+
+	free(entries);
+	closedir(dir);
+	return rv;
+}
@@ -48,62 +48,174 @@ static int vstr_enlarge(vstr_t *vstr)
 	return 0;
 }
 
-int vstr_putc(vstr_t *vstr, char ch)
+int vstr_putn(vstr_t *vstr, const char *str, size_t len)
 {
-	// note: keep at least one character free at all times for vstr_termz
-	if (vstr->size + 2 > vstr->alloc)
+	// note: keeps at least one character free for a terminator
+	while (vstr->size + len + 1 > vstr->alloc)
 		if (vstr_enlarge(vstr))
 			return -ENOMEM;
 
-	vstr->data[vstr->size] = ch;
-	vstr->size++;
+	memcpy(vstr->data + vstr->size, str, len);
+	vstr->size += len;
 	return 0;
 }
 
-int vstr_cmp(vstr_t *vstr, const char *str)
+//
+// arena allocator
+//
+
+// note: data is aligned to ARENA_ALIGN because the header is
+struct arena_chunk_s {
+	arena_chunk_t *next;
+	size_t size;
+	size_t pad[2];
+	char data[];
+};
+
+#define ARENA_ALIGN 16
+#define ARENA_MIN_CHUNK (16 * 1024)
+#define ARENA_MAX_CHUNK (1024 * 1024)
+
+void arena_init(arena_t *arena)
+{
+	memset(arena, 0, sizeof(*arena));
+}
+
+void arena_free(arena_t *arena)
 {
-	size_t len;
+	arena_chunk_t *chunk, *next;
 
-	len = strlen(str);
-	if (vstr->size < len)
-		len = vstr->size;
+	for (chunk = arena->chunks; chunk; chunk = next) {
+		next = chunk->next;
+		free(chunk);
+	}
 
-	return memcmp(vstr->data, str, len);
+	arena_init(arena);
 }
 
-char *vstr_strdup(vstr_t *vstr)
+// frees everything allocated from arena, but keeps the current chunk for
+// reuse
+void arena_reset(arena_t *arena)
 {
-	char *str;
+	arena_chunk_t *chunk, *next;
+
+	if (!arena->chunks)
+		return;
+
+	for (chunk = arena->chunks->next; chunk; chunk = next) {
+		next = chunk->next;
+		free(chunk);
+	}
+
+	chunk = arena->chunks;
+	chunk->next = NULL;
+	arena->num_chunks = 1;
+	arena->total = chunk->size;
+	arena->ptr = chunk->data;
+	arena->end = chunk->data + chunk->size;
+}
 
-	str = malloc(vstr->size + 1);
-	if (!str)
-		return NULL;
+static arena_chunk_t *arena_new_chunk(arena_t *arena, size_t size)
+{
+	arena_chunk_t *chunk;
 
-	memcpy(str, vstr->data, vstr->size);
-	str[vstr->size] = 0;
+	chunk = malloc(sizeof(arena_chunk_t) + size);
+	if (!chunk)
+		return NULL;
 
-	return str;
+	chunk->size = size;
+	arena->num_chunks++;
+	arena->total += size;
+	return chunk;
 }
 
-void vstr_termz(vstr_t *vstr)
+void *arena_alloc(arena_t *arena, size_t size)
 {
-	vstr->data[vstr->size] = 0;
+	arena_chunk_t *chunk;
+	size_t chunk_size;
+	void *rv;
+
+	size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+	arena->num_allocs++;
+	arena->used += size;
+
+	if ((size_t)(arena->end - arena->ptr) >= size) {
+		rv = arena->ptr;
+		arena->ptr += size;
+		return rv;
+	}
+
+	// chunks grow with the arena to keep their number low
+	chunk_size = arena->total / 2;
+	if (chunk_size < ARENA_MIN_CHUNK)
+		chunk_size = ARENA_MIN_CHUNK;
+	if (chunk_size > ARENA_MAX_CHUNK)
+		chunk_size = ARENA_MAX_CHUNK;
+
+	// big allocations get a chunk of their own, which is put behind the
+	// current one so the free space left in the latter isn't wasted
+	if (size > chunk_size / 4 && arena->chunks) {
+		chunk = arena_new_chunk(arena, size);
+		if (!chunk)
+			return NULL;
+
+		chunk->next = arena->chunks->next;
+		arena->chunks->next = chunk;
+		return chunk->data;
+	}
+
+	if (chunk_size < size)
+		chunk_size = size;
+
+	chunk = arena_new_chunk(arena, chunk_size);
+	if (!chunk)
+		return NULL;
+
+	chunk->next = arena->chunks;
+	arena->chunks = chunk;
+	arena->ptr = chunk->data + size;
+	arena->end = chunk->data + chunk_size;
+	return chunk->data;
 }
 
-float vstr_atof(vstr_t *vstr)
+char *arena_strndup(arena_t *arena, const char *str, size_t len)
 {
-	if (!vstr->size)
-		return 0;
+	char *copy;
+
+	copy = arena_alloc(arena, len + 1);
+	if (!copy)
+		return NULL;
+
+	memcpy(copy, str, len);
+	copy[len] = 0;
 
-	vstr_termz(vstr);
-	return atof(vstr->data);
+	return copy;
 }
 
-size_t vstr_atoz(vstr_t *vstr)
+// moves all of slave's chunks to master, slave is left empty
+void arena_adopt(arena_t *master, arena_t *slave)
 {
-	if (!vstr->size)
-		return 0;
+	arena_chunk_t *last;
+
+	if (!slave->chunks)
+		return;
+
+	if (!master->chunks) {
+		*master = *slave;
+		arena_init(slave);
+		return;
+	}
+
+	// master keeps allocating from its current chunk
+	for (last = slave->chunks; last->next; last = last->next)
+		;
+
+	last->next = master->chunks->next;
+	master->chunks->next = slave->chunks;
+	master->num_chunks += slave->num_chunks;
+	master->total += slave->total;
+	master->num_allocs += slave->num_allocs;
+	master->used += slave->used;
 
-	vstr_termz(vstr);
-	return strtoull(vstr->data, NULL, 10);
+	arena_init(slave);
 }
@@ -22,6 +22,9 @@ Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
 #include <errno.h>
 #include <stdbool.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 #include "elist.h"
 
 #ifdef DEBUG
@@ -45,26 +48,151 @@ typedef struct {
 void vstr_init(vstr_t *vstr);
 void vstr_free(vstr_t *vstr);
 void vstr_clear(vstr_t *vstr);
-int vstr_putc(vstr_t *vstr, char ch);
-int vstr_cmp(vstr_t *vstr, const char *str);
-char *vstr_strdup(vstr_t *vstr);
-void vstr_termz(vstr_t *vstr);
-float vstr_atof(vstr_t *vstr);
-size_t vstr_atoz(vstr_t *vstr);
+int vstr_putn(vstr_t *vstr, const char *str, size_t len);
+
+typedef struct arena_chunk_s arena_chunk_t;
+
+typedef struct {
+	arena_chunk_t *chunks; // the first one is the one being filled
+	char *ptr, *end;
+	size_t num_chunks, total;
+	size_t num_allocs, used; // everything ever allocated (see --profile)
+} arena_t;
+
+void arena_init(arena_t *arena);
+void arena_free(arena_t *arena);
+void arena_reset(arena_t *arena);
+void *arena_alloc(arena_t *arena, size_t size);
+char *arena_strndup(arena_t *arena, const char *str, size_t len);
+void arena_adopt(arena_t *master, arena_t *slave);
+
+// intern.c
+
+extern const char intern_classname[];
+extern const char intern_worldspawn[];
+extern const char intern_mapcat_discard[];
+extern const char intern_mapcat_prefix[];
+extern const char intern_origin[];
+extern const char intern_target[];
+extern const char intern_targetname[];
+extern const char intern_team[];
+extern const char intern_discard_shader[];
+
+const char *intern(const char *str, size_t len);
+void intern_free(void);
+
+// scan.c
+
+size_t scan_space(const char *p, const char *e);
+size_t scan_bare(const char *p, const char *e);
+size_t scan_quoted(const char *p, const char *e);
+size_t scan_structure(const char *p, const char *e);
+size_t scan_comment(const char *p, const char *e);
+
+// number.c
+
+int parse_float(const char *str, size_t len, float *out);
+float str_to_float(const char *str, size_t len);
+size_t str_to_size(const char *str, size_t len);
+
+#define FLOAT_BUFFER 64
+
+size_t format_float_fixed(char *buf, float x, int decimals);
+size_t format_float_short(char *buf, float x);
+size_t format_size(char *buf, size_t x);
+
+// compress.c
+
+#define COMPRESS_NONE 0
+#define COMPRESS_GZIP 1
+#define COMPRESS_ZSTD 2
+
+typedef struct decompress_s decompress_t;
+typedef struct compress_s compress_t;
+
+int compress_format(const char *data, size_t size);
+int compress_format_of(const char *path);
+bool compress_available(int format);
+const char *compress_name(int format);
+decompress_t *decompress_open(FILE *fp, const char *path, int format,
+                              const char *head, size_t head_size);
+ssize_t decompress_read(decompress_t *dec, char *buf, size_t size);
+void decompress_close(decompress_t *dec);
+compress_t *compress_open(int fd, const char *path, int format, int jobs);
+int compress_write(compress_t *comp, const void *data, size_t size);
+int compress_finish(compress_t *comp);
+void compress_free(compress_t *comp);
+
+// output.c
+
+#define OUTPUT_BUFFER (64 * 1024)
+#define OUTPUT_IOVECS 1024
+
+typedef struct {
+	int fd;
+	vstr_t *mem; // used instead of fd if not NULL
+	compress_t *comp; // writes to fd if not NULL, see output_finish
+	int error; // the first one (errno)
+	bool copy; // nothing passed to output_put outlives the call
+
+	struct iovec iov[OUTPUT_IOVECS];
+	size_t num_iov;
+	char buf[OUTPUT_BUFFER];
+	size_t buf_used;
+} output_t;
+
+void output_init(output_t *out, int fd);
+void output_init_mem(output_t *out, vstr_t *mem);
+int output_flush(output_t *out);
+int output_finish(output_t *out);
+char *output_reserve(output_t *out, size_t size);
+void output_commit(output_t *out, size_t size);
+void output_put(output_t *out, const void *data, size_t size);
+void output_puts(output_t *out, const char *str);
 
 // lexer.c
 
 #define LEXER_BUFFER 1024
 
+// token kinds, see lexer_get_token
+#define TOKEN_WORD 0 // a bare word that's none of the below
+#define TOKEN_QUOTED 1
+#define TOKEN_NUMBER 2 // bare and starts like one, it's not converted yet
+#define TOKEN_LBRACE 3
+#define TOKEN_RBRACE 4
+#define TOKEN_LPAREN 5
+#define TOKEN_RPAREN 6
+#define TOKEN_PATCHDEF2 7
+
 typedef struct {
 	int error;
 	const char *path;
 	FILE *fp;
+	decompress_t *dec; // reads fp if the input is compressed
 	bool eof;
 
-	vstr_t *token;
+	// regular files are mapped in whole and scanned in place, buf is only
+	// used for pipes and other things that can't be mmapped
+	char *map;
+	size_t map_size;
+	dev_t map_dev;
+	ino_t map_ino;
+
+	// the whole input if it's in memory (mapped or split into chunks),
+	// tokens can be located in it with token_cc
+	const char *src;
+	size_t token_cc; // where the last bare token began
+
+	// the last token, valid until the next lexer_get_token. It points
+	// into the input, unless it straddled a refill of buf and had to be
+	// copied to token_buf.
+	const char *token;
+	size_t token_size;
+	vstr_t *token_buf;
+	bool token_copied;
+
 	char buf[LEXER_BUFFER];
-	char *buf_c, *buf_e;
+	const char *buf_c, *buf_e;
 
 	size_t cc, lc, Cc; // character, line, and column counters
 	char last;
@@ -72,47 +200,87 @@ typedef struct {
 	bool in_token;
 	bool in_quote;
 	bool in_comment;
+
+	int token_kind; // of the last token
+	bool token_quoted; // ... or a part of it
+
+	bool quiet; // don't print anything, only set suppressed
+	bool suppressed;
+	bool partial; // the buffer might end in the middle of an entity
+
+	size_t num_tokens, num_floats; // see --profile
 } lexer_state_t;
 
+typedef struct {
+	size_t offs; // of the opening brace the chunk begins with
+	size_t lc, Cc; // the line and column counters at offs
+	bool in_entity; // the brace opens a brush, not an entity
+} lexer_split_t;
+
 int lexer_open(lexer_state_t *ls, const char *path, vstr_t *token);
+void lexer_open_chunk(lexer_state_t *ls, const char *path, const char *buf,
+                      const lexer_split_t *start, size_t end, vstr_t *token);
 void lexer_close(lexer_state_t *ls);
 int lexer_get_token(lexer_state_t *ls);
 int lexer_assert(lexer_state_t *ls, const char *match, const char *desc);
-int lexer_assert_or_eof(lexer_state_t *ls, const char *match, const char *desc);
+int lexer_expect(lexer_state_t *ls, int kind, const char *desc);
+int lexer_expect_or_eof(lexer_state_t *ls, int kind, const char *desc);
 void lexer_perror(lexer_state_t *ls, const char *fmt, ...);
 void lexer_perror_eg(lexer_state_t *ls, const char *expected);
 int lexer_get_floats(lexer_state_t *ls, float *out, size_t count);
+int lexer_read_face(lexer_state_t *ls, float *def, float *texmap);
+int lexer_read_patch_row(lexer_state_t *ls, float *out, size_t count);
+size_t lexer_find_splits(const char *buf, size_t size, size_t chunk_size,
+                         lexer_split_t *splits, size_t max_splits);
 
 // mapcat.c
 
+// note: shaders, keys and classnames are interned (see intern.c)
+
+// faces are stored in blocks of parallel arrays, face i of a block is
+// (def[i], shader[i], texmap[i]). The faces of a brush are always adjacent
+// and in the same block.
 typedef struct {
-	float def[9];
-	char *shader;
-	float texmap[8];
-	elist_header_t list;
-} brush_face_t;
+	float (*def)[9];
+	const char **shader;
+	float (*texmap)[8];
+	size_t count, alloc;
+} face_block_t;
 
 typedef struct {
 	size_t xres, yres;
 	float *def; // (xres * yres * 5) floats
-	char *shader;
+	const char *shader;
 } brush_patch_t;
 
 typedef struct {
-	brush_face_t *faces;
+	face_block_t *block;
+	size_t first_face, num_faces;
 	brush_patch_t *patch;
+
+	// the brush in the input, braces included (NULL if it's not in memory)
+	const char *src;
+	size_t src_len;
+
 	elist_header_t list;
 } brush_t;
 
 typedef struct {
-	char *key;
+	const char *key;
 	char *value;
+	const char *prefix; // goes before value, NULL if none
 	elist_header_t list;
 } entity_key_t;
 
 typedef struct {
-	char *classname;
+	const char *classname;
 	bool discard;
+	bool modified; // some keys or brushes differ from src
+
+	// the entity in the input, braces included (NULL if it's not in
+	// memory)
+	const char *src;
+	size_t src_len;
 
 	brush_t *brushes;
 	entity_key_t *keys;
@@ -120,20 +288,147 @@ typedef struct {
 	elist_header_t list;
 } entity_t;
 
+// a mapped input that brushes and entities can point into
 typedef struct {
+	char *data;
+	size_t size;
+	dev_t dev;
+	ino_t ino;
+	elist_header_t list;
+} map_source_t;
+
+typedef struct map_stream_s map_stream_t;
+
+typedef struct {
+	arena_t arena; // everything below is allocated from here
+	map_stream_t *stream; // see map_stream_open
+	map_source_t *sources; // unmapped by map_free
+
 	entity_t *worldspawn;
 	entity_t *entities;
 
+	face_block_t *face_block; // the one new faces are added to
+
 	// note: num_entities doesn't include the worldspawn
 	size_t num_entities, num_discarded_entities;
 	size_t num_brushes, num_discarded_brushes;
 	size_t num_patches, num_discarded_patches;
+	size_t num_duplicate_entities, num_duplicate_brushes; // see dedupe.c
+	size_t num_duplicate_patches;
+	size_t num_tokens, num_floats; // lexed while reading (see --profile)
 } map_t;
 
+// map_write flags
+#define MAPCAT_COMPACT 0x01 // shortest numbers, no comments
+#define MAPCAT_REFORMAT 0x02 // don't copy anything verbatim from the inputs
+#define MAPCAT_BINARY 0x04 // see binary.c
+
 void map_init(map_t *map);
 void map_free(map_t *map);
-int map_read(map_t *map, const char *path);
-int map_write(const map_t *map, const char *path);
+int map_read(map_t *map, const char *path, int jobs);
+int map_write(const map_t *map, const char *path, int flags, int jobs);
 int map_postprocess(map_t *map);
 int map_merge(map_t *master, map_t *slave);
 void map_print_stats(const char *path, const map_t *map);
+
+// streaming (see mapcat.c)
+struct map_stream_s {
+	output_t out, spool; // the descriptors are -1 once they're closed
+	const char *path;
+	int flags;
+	bool has_worldspawn; // the first worldspawn's keys were written
+	size_t num_brushes, num_entities; // written so far
+
+	// the input being read
+	map_t *input;
+	const entity_t *worldspawn;
+	const char *prefix;
+
+	map_t entity, brush; // scratch space
+};
+
+int map_stream_open(map_stream_t *stream, const char *path, int flags);
+int map_stream_read(map_stream_t *stream, map_t *map, const char *path);
+int map_stream_close(map_stream_t *stream);
+void map_stream_abort(map_stream_t *stream);
+
+// dedupe.c
+
+int map_dedupe(map_t *map);
+
+// region.c
+
+typedef struct {
+	double normal[3], dist;
+} plane_t;
+
+int plane_from_points(plane_t *plane, const float *def);
+int map_region(map_t *map, const float *mins, const float *maxs);
+
+// binary.c
+
+int map_write_binary(const map_t *map, const char *path, int flags);
+int map_read_binary(map_t *map, const char *path);
+
+// cache.c
+
+#define CACHE_DEFAULT_SIZE (1024ull * 1024 * 1024)
+
+typedef struct {
+	const char *dir;
+	uint64_t max_size; // in bytes, see cache_trim
+	int flags; // for map_write_binary
+	uint64_t seed[2]; // every entry's hash starts with this
+} cache_t;
+
+void cache_init(cache_t *cache, const char *dir, int flags);
+char *cache_entry(const cache_t *cache, const char *path);
+int cache_lookup(const char *entry);
+int cache_store(const cache_t *cache, const map_t *map, const char *entry);
+int cache_trim(const cache_t *cache);
+
+// profile.c
+
+// phases
+#define PROFILE_READ 0
+#define PROFILE_POSTPROCESS 1
+#define PROFILE_MERGE 2
+#define PROFILE_WRITE 3
+#define PROFILE_PHASES 4
+
+typedef struct {
+	double wall[PROFILE_PHASES], cpu[PROFILE_PHASES]; // in seconds
+	uint64_t bytes_read, bytes_written;
+	uint64_t tokens, floats;
+	uint64_t allocs, alloc_bytes; // from the arenas
+	long peak_rss; // of the whole process so far, in kilobytes
+	double process_cpu; // of all the threads, see profile_finish
+} profile_t;
+
+typedef struct {
+	double wall, cpu;
+	double trace; // see trace_begin
+} profile_clock_t;
+
+void profile_start(profile_clock_t *clock);
+void profile_stop(profile_clock_t *clock, profile_t *profile, int phase,
+                  const char *path);
+void profile_add_map(profile_t *profile, const map_t *map);
+void profile_add(profile_t *total, const profile_t *profile);
+void profile_finish(profile_t *profile);
+void profile_print(const char *name, const profile_t *profile);
+void profile_print_json(const char *name, const profile_t *profile);
+void json_print_string(FILE *fp, const char *str);
+
+// trace.c
+
+// entities this big get spans of their own
+#define TRACE_ENTITY_MIN (256 * 1024)
+
+int trace_open(const char *path);
+int trace_close(const char *path);
+double trace_begin(void);
+void trace_end(double start, const char *name, const char *path,
+               uint64_t bytes);
+void trace_counter(const char *name, uint64_t value);
+void trace_rss(void);
@@ -0,0 +1,527 @@
+/*
+Copyright (C) 2016  Paweł Redman
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 3
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software Foundation,
+Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+*/
+
+// Compressed inputs are recognized by their first bytes and decompressed
+// as the lexer goes (see fill_buffer), they never touch the disk
+// uncompressed. Outputs are compressed if their names end in .gz or .zst,
+// everything written to the output_t goes through a compress_t then.
+//
+// Both formats are optional (see HAVE_ZLIB and HAVE_ZSTD in the Makefile).
+// A build without one still recognizes it, only to say it can't read it.
+
+#include "common.h"
+#include <unistd.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#define COMPRESS_BUFFER (64 * 1024)
+#define ZSTD_LEVEL 3 // zstd's own default
+
+static const char *format_names[] = {
+	[COMPRESS_NONE] = "uncompressed",
+	[COMPRESS_GZIP] = "gzip",
+	[COMPRESS_ZSTD] = "zstd"
+};
+
+//RETURN VALUE
+//	the format of the data that begins with [data, data + size)
+int compress_format(const char *data, size_t size)
+{
+	const unsigned char *p = (const unsigned char*)data;
+
+	if (size >= 2 && p[0] == 0x1F && p[1] == 0x8B)
+		return COMPRESS_GZIP;
+
+	if (size >= 4 && p[0] == 0x28 && p[1] == 0xB5 && p[2] == 0x2F &&
+	    p[3] == 0xFD)
+		return COMPRESS_ZSTD;
+
+	return COMPRESS_NONE;
+}
+
+bool compress_available(int format)
+{
+	switch (format) {
+	case COMPRESS_NONE:
+		return true;
+#ifdef HAVE_ZLIB
+	case COMPRESS_GZIP:
+		return true;
+#endif
+#ifdef HAVE_ZSTD
+	case COMPRESS_ZSTD:
+		return true;
+#endif
+	}
+
+	return false;
+}
+
+const char *compress_name(int format)
+{
+	return format_names[format];
+}
+
+static bool has_suffix(const char *str, const char *suffix)
+{
+	size_t len = strlen(str), suffix_len = strlen(suffix);
+
+	return len > suffix_len && !strcmp(str + len - suffix_len, suffix);
+}
+
+//RETURN VALUE
+//	the format an output at path should be written in
+int compress_format_of(const char *path)
+{
+	if (has_suffix(path, ".gz"))
+		return COMPRESS_GZIP;
+
+	if (has_suffix(path, ".zst"))
+		return COMPRESS_ZSTD;
+
+	return COMPRESS_NONE;
+}
+
+//
+// decompression
+//
+
+struct decompress_s {
+	int format;
+	const char *path;
+	FILE *fp;
+	bool end; // of a gzip member or zstd frame, see decompress_read
+
+	char in[COMPRESS_BUFFER];
+	const char *in_c, *in_e;
+
+#ifdef HAVE_ZLIB
+	z_stream z;
+#endif
+#ifdef HAVE_ZSTD
+	ZSTD_DStream *zstd;
+#endif
+};
+
+//RETURN VALUE
+//	a decompressor that reads from fp (after the already read bytes in
+//	[head, head + head_size)), NULL on error (errno is set)
+decompress_t *decompress_open(FILE *fp, const char *path, int format,
+                              const char *head, size_t head_size)
+{
+	decompress_t *dec;
+
+	dec = malloc(sizeof(decompress_t));
+	if (!dec) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	memset(dec, 0, sizeof(*dec));
+	dec->format = format;
+	dec->path = path;
+	dec->fp = fp;
+
+	memcpy(dec->in, head, head_size);
+	dec->in_c = dec->in;
+	dec->in_e = dec->in + head_size;
+
+	switch (format) {
+#ifdef HAVE_ZLIB
+	case COMPRESS_GZIP:
+		// +16 for the gzip header instead of the zlib one
+		if (inflateInit2(&dec->z, 15 + 16) != Z_OK)
+			goto error_oom;
+		return dec;
+#endif
+#ifdef HAVE_ZSTD
+	case COMPRESS_ZSTD:
+		dec->zstd = ZSTD_createDStream();
+		if (!dec->zstd)
+			goto error_oom;
+		return dec;
+#endif
+	}
+
+	fprintf(stderr, "%s: " PROGRAM_NAME " was built without %s support\n",
+	        path, format_names[format]);
+	free(dec);
+	errno = ENOTSUP;
+	return NULL;
+
+#if defined(HAVE_ZLIB) || defined(HAVE_ZSTD)
+error_oom:
+	free(dec);
+	errno = ENOMEM;
+	return NULL;
+#endif
+}
+
+//RETURN VALUES
+//	<0 on error
+//	0 on success
+//	1 when there's no input left
+static int fill_input(decompress_t *dec)
+{
+	size_t read;
+
+	if (dec->in_c < dec->in_e)
+		return 0;
+
+	read = fread(dec->in, 1, sizeof(dec->in), dec->fp);
+	if (!read && ferror(dec->fp))
+		return -errno;
+
+	dec->in_c = dec->in;
+	dec->in_e = dec->in + read;
+	return read ? 0 : 1;
+}
+
+#ifdef HAVE_ZLIB
+//RETURN VALUE
+//	the number of bytes decompressed, -1 on error
+static ssize_t read_gzip(decompress_t *dec, char *buf, size_t size)
+{
+	dec->z.next_in = (unsigned char*)dec->in_c;
+	dec->z.avail_in = dec->in_e - dec->in_c;
+	dec->z.next_out = (unsigned char*)buf;
+	dec->z.avail_out = size;
+
+	// gzip members can be concatenated, the next one starts afresh
+	if (dec->end) {
+		if (inflateReset(&dec->z) != Z_OK)
+			return -1;
+
+		dec->end = false;
+	}
+
+	switch (inflate(&dec->z, Z_NO_FLUSH)) {
+	case Z_STREAM_END:
+		dec->end = true;
+		// fall through
+	case Z_OK:
+	case Z_BUF_ERROR: // no progress, more input is needed
+		break;
+	default:
+		fprintf(stderr, "%s: %s\n", dec->path, dec->z.msg ?
+		        dec->z.msg : "corrupt gzip data");
+		return -1;
+	}
+
+	dec->in_c = (const char*)dec->z.next_in;
+	return size - dec->z.avail_out;
+}
+#endif
+
+#ifdef HAVE_ZSTD
+// see read_gzip
+static ssize_t read_zstd(decompress_t *dec, char *buf, size_t size)
+{
+	ZSTD_inBuffer in = {dec->in_c, dec->in_e - dec->in_c, 0};
+	ZSTD_outBuffer out = {buf, size, 0};
+	size_t ret;
+
+	// frames are concatenated by the library itself
+	ret = ZSTD_decompressStream(dec->zstd, &out, &in);
+	if (ZSTD_isError(ret)) {
+		fprintf(stderr, "%s: %s\n", dec->path,
+		        ZSTD_getErrorName(ret));
+		return -1;
+	}
+
+	dec->end = !ret;
+	dec->in_c += in.pos;
+	return out.pos;
+}
+#endif
+
+//RETURN VALUE
+//	the number of bytes read, less than size only at the end of the data,
+//	-errno on error
+ssize_t decompress_read(decompress_t *dec, char *buf, size_t size)
+{
+	size_t done = 0;
+
+	while (done < size) {
+		ssize_t ret;
+
+		ret = fill_input(dec);
+		if (ret < 0)
+			return ret;
+
+		if (ret == 1) {
+			if (dec->end)
+				break;
+
+			fprintf(stderr, "%s: unexpected end of %s data\n",
+			        dec->path, format_names[dec->format]);
+			return -EIO;
+		}
+
+		switch (dec->format) {
+#ifdef HAVE_ZLIB
+		case COMPRESS_GZIP:
+			ret = read_gzip(dec, buf + done, size - done);
+			break;
+#endif
+#ifdef HAVE_ZSTD
+		case COMPRESS_ZSTD:
+			ret = read_zstd(dec, buf + done, size - done);
+			break;
+#endif
+		default:
+			ret = -1;
+		}
+
+		if (ret < 0)
+			return -EIO;
+
+		done += ret;
+	}
+
+	return done;
+}
+
+void decompress_close(decompress_t *dec)
+{
+	if (!dec)
+		return;
+
+#ifdef HAVE_ZLIB
+	if (dec->format == COMPRESS_GZIP)
+		inflateEnd(&dec->z);
+#endif
+#ifdef HAVE_ZSTD
+	if (dec->format == COMPRESS_ZSTD)
+		ZSTD_freeDStream(dec->zstd);
+#endif
+
+	free(dec);
+}
+
+//
+// compression
+//
+
+struct compress_s {
+	int format;
+	int fd;
+	char out[COMPRESS_BUFFER];
+
+#ifdef HAVE_ZLIB
+	z_stream z;
+#endif
+#ifdef HAVE_ZSTD
+	ZSTD_CCtx *zstd;
+#endif
+};
+
+//RETURN VALUE
+//	a compressor that writes to fd, NULL on error (errno is set)
+// note: zstd compresses with up to jobs threads
+compress_t *compress_open(int fd, const char *path, int format, int jobs)
+{
+	compress_t *comp;
+
+	comp = malloc(sizeof(compress_t));
+	if (!comp) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	memset(comp, 0, sizeof(*comp));
+	comp->format = format;
+	comp->fd = fd;
+
+	switch (format) {
+#ifdef HAVE_ZLIB
+	case COMPRESS_GZIP:
+		if (deflateInit2(&comp->z, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+		                 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+			goto error_oom;
+		return comp;
+#endif
+#ifdef HAVE_ZSTD
+	case COMPRESS_ZSTD:
+		comp->zstd = ZSTD_createCCtx();
+		if (!comp->zstd)
+			goto error_oom;
+
+		ZSTD_CCtx_setParameter(comp->zstd, ZSTD_c_compressionLevel,
+		                       ZSTD_LEVEL);
+
+		// fails harmlessly if the library is single-threaded
+		if (jobs > 1)
+			ZSTD_CCtx_setParameter(comp->zstd, ZSTD_c_nbWorkers,
+			                       jobs);
+		return comp;
+#endif
+	}
+
+	fprintf(stderr, "%s: " PROGRAM_NAME " was built without %s support\n",
+	        path, format_names[format]);
+	free(comp);
+	errno = ENOTSUP;
+	return NULL;
+
+#if defined(HAVE_ZLIB) || defined(HAVE_ZSTD)
+error_oom:
+	free(comp);
+	errno = ENOMEM;
+	return NULL;
+#endif
+}
+
+#if defined(HAVE_ZLIB) || defined(HAVE_ZSTD)
+//RETURN VALUE
+//	0 on success, errno on error
+static int write_out(compress_t *comp, size_t size)
+{
+	const char *p = comp->out;
+
+	while (size) {
+		ssize_t ret;
+
+		ret = write(comp->fd, p, size);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return errno;
+		}
+
+		p += ret;
+		size -= ret;
+	}
+
+	return 0;
+}
+#endif
+
+#ifdef HAVE_ZLIB
+// see compress_put
+static int put_gzip(compress_t *comp, const void *data, size_t size,
+                    bool finish)
+{
+	int ret;
+
+	comp->z.next_in = (unsigned char*)data;
+	comp->z.avail_in = size;
+
+	do {
+		comp->z.next_out = (unsigned char*)comp->out;
+		comp->z.avail_out = sizeof(comp->out);
+
+		ret = deflate(&comp->z, finish ? Z_FINISH : Z_NO_FLUSH);
+		if (ret == Z_STREAM_ERROR)
+			return EIO;
+
+		ret = write_out(comp, sizeof(comp->out) - comp->z.avail_out);
+		if (ret)
+			return ret;
+	} while (comp->z.avail_in || !comp->z.avail_out);
+
+	return 0;
+}
+#endif
+
+#ifdef HAVE_ZSTD
+// see compress_put
+static int put_zstd(compress_t *comp, const void *data, size_t size,
+                    bool finish)
+{
+	ZSTD_inBuffer in = {data, size, 0};
+	size_t left;
+	int ret;
+
+	do {
+		ZSTD_outBuffer out = {comp->out, sizeof(comp->out), 0};
+
+		left = ZSTD_compressStream2(comp->zstd, &out, &in, finish ?
+		                            ZSTD_e_end : ZSTD_e_continue);
+		if (ZSTD_isError(left))
+			return EIO;
+
+		ret = write_out(comp, out.pos);
+		if (ret)
+			return ret;
+	} while (finish ? left != 0 : in.pos < in.size);
+
+	return 0;
+}
+#endif
+
+//RETURN VALUE
+//	0 on success, errno on error
+// note: finish ends the compressed data
+static int compress_put(compress_t *comp, const void *data, size_t size,
+                        bool finish)
+{
+	switch (comp->format) {
+#ifdef HAVE_ZLIB
+	case COMPRESS_GZIP:
+		return put_gzip(comp, data, size, finish);
+#endif
+#ifdef HAVE_ZSTD
+	case COMPRESS_ZSTD:
+		return put_zstd(comp, data, size, finish);
+#endif
+	}
+
+	return ENOTSUP;
+}
+
+// see compress_put
+int compress_write(compress_t *comp, const void *data, size_t size)
+{
+	return compress_put(comp, data, size, false);
+}
+
+// writes out the rest of the compressed data and frees comp
+//RETURN VALUE
+//	0 on success, errno on error
+int compress_finish(compress_t *comp)
+{
+	int ret;
+
+	ret = compress_put(comp, NULL, 0, true);
+	compress_free(comp);
+	return ret;
+}
+
+void compress_free(compress_t *comp)
+{
+	if (!comp)
+		return;
+
+#ifdef HAVE_ZLIB
+	if (comp->format == COMPRESS_GZIP)
+		deflateEnd(&comp->z);
+#endif
+#ifdef HAVE_ZSTD
+	if (comp->format == COMPRESS_ZSTD)
+		ZSTD_freeCCtx(comp->zstd);
+#endif
+
+	free(comp);
+}
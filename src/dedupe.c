@@ -0,0 +1,445 @@
+/*
+Copyright (C) 2016  Paweł Redman
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 3
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software Foundation,
+Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+*/
+
+// -d drops worldspawn brushes and entities that are exact copies of ones
+// that came before them, which is what merging overlapping prefabs (or the
+// same prefab twice) leaves behind. Every brush and entity is hashed once
+// and looked up in a table, equal hashes are confirmed by comparing the
+// two for real.
+//
+// A brush's hash doesn't depend on the order of its faces and an entity's
+// doesn't depend on the order of its keys, so neither does equality. The
+// brushes of an entity are compared in order.
+//
+// Faces are compared by their planes rather than the points that were
+// written for them, so the same brush saved by a different editor is
+// still the same. A plane is rounded to PLANE_NORMAL_QUANTUM and
+// PLANE_DIST_QUANTUM first, planes that are closer than that but round
+// differently aren't equal. Everything else is compared as a number (-0
+// and 0 are equal).
+
+#include "common.h"
+#include <math.h>
+#include <stdint.h>
+
+#define PLANE_NORMAL_QUANTUM 1e-5
+#define PLANE_DIST_QUANTUM 1e-2
+
+// a face's plane, rounded (see plane_from_points)
+typedef struct {
+	int64_t normal[3], dist;
+	bool degenerate; // the points are on a line, they're used instead
+} face_plane_t;
+
+typedef struct {
+	uint64_t hash;
+	const void *item; // NULL if the slot is empty
+} dedupe_slot_t;
+
+typedef struct {
+	dedupe_slot_t *slots; // open addressing, linear probing
+	size_t size; // a power of two
+} dedupe_table_t;
+
+// the finalizer of splitmix64, so that sums of hashes stay well mixed
+static uint64_t mix(uint64_t hash)
+{
+	hash ^= hash >> 30;
+	hash *= 0xbf58476d1ce4e5b9ull;
+	hash ^= hash >> 27;
+	hash *= 0x94d049bb133111ebull;
+	hash ^= hash >> 31;
+	return hash;
+}
+
+static uint64_t hash_floats(uint64_t hash, const float *floats, size_t count)
+{
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		uint32_t bits;
+
+		// -0 becomes 0
+		float value = floats[i] + 0.0f;
+
+		memcpy(&bits, &value, sizeof(bits));
+		hash ^= bits;
+		hash *= 0x100000001b3ull;
+	}
+
+	return hash;
+}
+
+static uint64_t hash_string(uint64_t hash, const char *str)
+{
+	if (!str)
+		return hash;
+
+	for (; *str; str++) {
+		hash ^= (unsigned char)*str;
+		hash *= 0x100000001b3ull;
+	}
+
+	return hash;
+}
+
+// note: interned strings are hashed by their pointers
+static uint64_t hash_pointer(uint64_t hash, const void *ptr)
+{
+	return mix(hash ^ (uintptr_t)ptr);
+}
+
+static bool floats_equal(const float *a, const float *b, size_t count)
+{
+	size_t i;
+
+	for (i = 0; i < count; i++)
+		if (a[i] != b[i])
+			return false;
+
+	return true;
+}
+
+static void face_plane(face_plane_t *out, const float *def)
+{
+	plane_t plane;
+	int i;
+
+	memset(out, 0, sizeof(*out));
+
+	if (plane_from_points(&plane, def)) {
+		out->degenerate = true;
+		return;
+	}
+
+	for (i = 0; i < 3; i++)
+		out->normal[i] = llround(plane.normal[i] /
+		                         PLANE_NORMAL_QUANTUM);
+	out->dist = llround(plane.dist / PLANE_DIST_QUANTUM);
+}
+
+static uint64_t face_hash(const face_block_t *block, size_t i)
+{
+	uint64_t hash = 0xcbf29ce484222325ull;
+	face_plane_t plane;
+	int j;
+
+	face_plane(&plane, block->def[i]);
+
+	if (plane.degenerate) {
+		hash = hash_floats(hash, block->def[i], 9);
+	} else {
+		for (j = 0; j < 3; j++)
+			hash = mix(hash ^ plane.normal[j]);
+		hash = mix(hash ^ plane.dist);
+	}
+
+	hash = hash_floats(hash, block->texmap[i], 8);
+	return hash_pointer(hash, block->shader[i]);
+}
+
+static uint64_t brush_hash(const brush_t *brush)
+{
+	const brush_patch_t *patch = brush->patch;
+	uint64_t hash;
+	size_t i;
+
+	if (patch) {
+		hash = hash_floats(patch->xres * 31 + patch->yres, patch->def,
+		                   patch->xres * patch->yres * 5);
+		return hash_pointer(hash, patch->shader);
+	}
+
+	// a sum doesn't care about the order
+	hash = brush->num_faces;
+	for (i = 0; i < brush->num_faces; i++)
+		hash += face_hash(brush->block, brush->first_face + i);
+
+	return mix(hash);
+}
+
+static bool faces_equal(const brush_t *a, size_t i, const brush_t *b,
+                        size_t j)
+{
+	face_plane_t pa, pb;
+
+	i += a->first_face;
+	j += b->first_face;
+
+	if (a->block->shader[i] != b->block->shader[j] ||
+	    !floats_equal(a->block->texmap[i], b->block->texmap[j], 8))
+		return false;
+
+	face_plane(&pa, a->block->def[i]);
+	face_plane(&pb, b->block->def[j]);
+
+	if (pa.degenerate || pb.degenerate)
+		return pa.degenerate && pb.degenerate &&
+		       floats_equal(a->block->def[i], b->block->def[j], 9);
+
+	return !memcmp(pa.normal, pb.normal, sizeof(pa.normal)) &&
+	       pa.dist == pb.dist;
+}
+
+static size_t count_face(const brush_t *brush, const brush_t *of, size_t i)
+{
+	size_t j, count = 0;
+
+	for (j = 0; j < brush->num_faces; j++)
+		count += faces_equal(brush, j, of, i);
+
+	return count;
+}
+
+static bool brushes_equal(const brush_t *a, const brush_t *b)
+{
+	size_t i;
+
+	if (a->patch || b->patch) {
+		const brush_patch_t *pa = a->patch, *pb = b->patch;
+
+		return pa && pb && pa->shader == pb->shader &&
+		       pa->xres == pb->xres && pa->yres == pb->yres &&
+		       floats_equal(pa->def, pb->def,
+		                    pa->xres * pa->yres * 5);
+	}
+
+	if (a->num_faces != b->num_faces)
+		return false;
+
+	// the same faces, each one as many times
+	for (i = 0; i < a->num_faces; i++)
+		if (count_face(a, a, i) != count_face(b, a, i))
+			return false;
+
+	return true;
+}
+
+static uint64_t key_hash(const entity_key_t *key)
+{
+	uint64_t hash = 0xcbf29ce484222325ull;
+
+	hash = hash_string(hash, key->value);
+	hash = hash_pointer(hash, key->key);
+	return mix(hash_string(hash, key->prefix));
+}
+
+static uint64_t entity_hash(const entity_t *entity)
+{
+	const entity_key_t *key;
+	const brush_t *brush;
+	uint64_t keys = 0, brushes = 0;
+
+	elist_cfor(key, entity->keys, list)
+		keys += key_hash(key);
+
+	elist_cfor(brush, entity->brushes, list)
+		brushes = brushes * 0x100000001b3ull + brush_hash(brush);
+
+	return mix(hash_pointer(keys, entity->classname) ^ brushes);
+}
+
+static bool prefixes_equal(const char *a, const char *b)
+{
+	if (!a || !b)
+		return a == b;
+
+	return !strcmp(a, b);
+}
+
+static bool keys_equal(const entity_key_t *a, const entity_key_t *b)
+{
+	return a->key == b->key && !strcmp(a->value, b->value) &&
+	       prefixes_equal(a->prefix, b->prefix);
+}
+
+static size_t count_key(const entity_t *entity, const entity_key_t *of)
+{
+	const entity_key_t *key;
+	size_t count = 0;
+
+	elist_cfor(key, entity->keys, list)
+		count += keys_equal(key, of);
+
+	return count;
+}
+
+static bool entities_equal(const entity_t *a, const entity_t *b)
+{
+	const entity_key_t *key;
+	const brush_t *ba, *bb;
+	size_t num_a = 0, num_b = 0;
+
+	if (a->classname != b->classname)
+		return false;
+
+	elist_cfor(key, a->keys, list)
+		num_a++;
+	elist_cfor(key, b->keys, list)
+		num_b++;
+
+	if (num_a != num_b)
+		return false;
+
+	elist_cfor(key, a->keys, list)
+		if (count_key(a, key) != count_key(b, key))
+			return false;
+
+	for (ba = a->brushes, bb = b->brushes; ba && bb;
+	     ba = elist_cnext(ba, list), bb = elist_cnext(bb, list))
+		if (!brushes_equal(ba, bb))
+			return false;
+
+	return !ba && !bb;
+}
+
+static int table_init(dedupe_table_t *table, size_t count)
+{
+	// keep the load factor under 1/2
+	for (table->size = 16; table->size < count * 2; table->size *= 2)
+		;
+
+	table->slots = calloc(table->size, sizeof(dedupe_slot_t));
+	if (!table->slots)
+		return -ENOMEM;
+
+	return 0;
+}
+
+//RETURN VALUE
+//	the item that's equal to item if there's one in the table (item isn't
+//	added then), NULL otherwise
+static const void *table_insert(dedupe_table_t *table, uint64_t hash,
+                                const void *item,
+                                bool (*equal)(const void*, const void*))
+{
+	size_t i;
+
+	for (i = hash & (table->size - 1); ; i = (i + 1) & (table->size - 1)) {
+		dedupe_slot_t *slot = table->slots + i;
+
+		if (!slot->item) {
+			slot->hash = hash;
+			slot->item = item;
+			return NULL;
+		}
+
+		if (slot->hash == hash && equal(slot->item, item))
+			return slot->item;
+	}
+}
+
+static bool brushes_equal_cb(const void *a, const void *b)
+{
+	return brushes_equal(a, b);
+}
+
+static bool entities_equal_cb(const void *a, const void *b)
+{
+	return entities_equal(a, b);
+}
+
+static void drop_brush(map_t *map, const brush_t *brush)
+{
+	if (brush->patch) {
+		map->num_patches--;
+		map->num_duplicate_patches++;
+	} else {
+		map->num_brushes--;
+		map->num_duplicate_brushes++;
+	}
+}
+
+static int dedupe_worldspawn(map_t *map)
+{
+	entity_t *worldspawn = map->worldspawn;
+	brush_t *brush, *next;
+	dedupe_table_t table;
+	size_t count = 0;
+
+	elist_for(brush, worldspawn->brushes, list)
+		count++;
+
+	if (table_init(&table, count))
+		return 1;
+
+	for (brush = worldspawn->brushes; brush; brush = next) {
+		next = elist_next(brush, list);
+
+		if (!table_insert(&table, brush_hash(brush), brush,
+		                  brushes_equal_cb))
+			continue;
+
+		elist_unlink(&worldspawn->brushes, brush, list);
+		drop_brush(map, brush);
+		worldspawn->modified = true;
+	}
+
+	free(table.slots);
+	return 0;
+}
+
+static int dedupe_entities(map_t *map)
+{
+	entity_t *entity, *next;
+	const brush_t *brush;
+	dedupe_table_t table;
+	size_t count = 0;
+
+	elist_for(entity, map->entities, list)
+		count++;
+
+	if (table_init(&table, count))
+		return 1;
+
+	for (entity = map->entities; entity; entity = next) {
+		next = elist_next(entity, list);
+
+		if (!table_insert(&table, entity_hash(entity), entity,
+		                  entities_equal_cb))
+			continue;
+
+		elist_unlink(&map->entities, entity, list);
+		map->num_entities--;
+		map->num_duplicate_entities++;
+
+		elist_cfor(brush, entity->brushes, list)
+			drop_brush(map, brush);
+	}
+
+	free(table.slots);
+	return 0;
+}
+
+// drops the duplicates and counts them (see map_print_stats)
+//RETURN VALUE
+//	0 on success, 1 if out of memory
+int map_dedupe(map_t *map)
+{
+	if (map->worldspawn && dedupe_worldspawn(map))
+		goto error_oom;
+
+	if (dedupe_entities(map))
+		goto error_oom;
+
+	return 0;
+
+error_oom:
+	fprintf(stderr, "error: out of memory\n");
+	return 1;
+}
@@ -103,6 +103,7 @@ elist_unlink_real((void**)(head), (entry), offsetin((entry), member))
 static inline void elist_append_list_real(void **head1, void *head2, size_t offs)
 {
 	elist_header_t *head1_header, *head2_header, *last1_header;
+	void *last1;
 
 	if (!*head1) {
 		*head1 = head2;
@@ -114,11 +115,12 @@ static inline void elist_append_list_real(void **head1, void *head2, size_t offs
 
 	head1_header = elist_header(*head1, offs);
 	head2_header = elist_header(head2, offs);
-	last1_header = elist_header(head1_header->prev, offs);
+	last1 = head1_header->prev;
+	last1_header = elist_header(last1, offs);
 
 	head1_header->prev = head2_header->prev;
 	last1_header->next = head2;
-	head2_header->prev = head1_header->prev;
+	head2_header->prev = last1;
 }
 
 #define elist_append_list(head1, head2, member) \
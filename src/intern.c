@@ -0,0 +1,221 @@
+/*
+Copyright (C) 2016  Paweł Redman
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 3
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software Foundation,
+Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+*/
+
+// Shaders, keys and classnames are interned: every distinct string is
+// stored once for the entire run and equal strings have equal pointers.
+// The strings mapcat itself looks for are interned in advance, so code can
+// compare against the pointers below instead of calling strcmp.
+//
+// The table is shared by all threads. Lookups go through a small per-thread
+// cache first, so that the common case (a string that's already interned)
+// doesn't take the lock.
+
+#include "common.h"
+#include <stdint.h>
+#include <pthread.h>
+
+const char intern_classname[] = "classname";
+const char intern_worldspawn[] = "worldspawn";
+const char intern_mapcat_discard[] = "mapcat_discard";
+const char intern_mapcat_prefix[] = "mapcat_prefix";
+const char intern_origin[] = "origin";
+const char intern_target[] = "target";
+const char intern_targetname[] = "targetname";
+const char intern_team[] = "team";
+const char intern_discard_shader[] = MAPCAT_DISCARD_SHADER;
+
+static const char *const well_known[] = {
+	intern_classname,
+	intern_worldspawn,
+	intern_mapcat_discard,
+	intern_mapcat_prefix,
+	intern_origin,
+	intern_target,
+	intern_targetname,
+	intern_team,
+	intern_discard_shader
+};
+
+typedef struct {
+	uint64_t hash;
+	const char *str;
+	size_t len;
+} intern_slot_t;
+
+static struct {
+	intern_slot_t *slots; // open addressing, linear probing
+	size_t size, count; // size is a power of two
+	arena_t arena; // the strings
+} table;
+
+static pthread_mutex_t table_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+#define INTERN_MIN_SIZE 1024
+#define INTERN_CACHE_SIZE 256 // has to be a power of two
+
+// canonical strings are never moved or freed (until intern_free), so the
+// cache can hold on to them without any locking
+static __thread intern_slot_t cache[INTERN_CACHE_SIZE];
+
+static uint64_t intern_hash(const char *str, size_t len)
+{
+	uint64_t hash = 0xcbf29ce484222325ull;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		hash ^= (unsigned char)str[i];
+		hash *= 0x100000001b3ull;
+	}
+
+	return hash;
+}
+
+static intern_slot_t *intern_find(uint64_t hash, const char *str, size_t len)
+{
+	size_t i;
+
+	for (i = hash & (table.size - 1); ; i = (i + 1) & (table.size - 1)) {
+		intern_slot_t *slot = table.slots + i;
+
+		if (!slot->str)
+			return slot;
+
+		if (slot->hash == hash && slot->len == len &&
+		    !memcmp(slot->str, str, len))
+			return slot;
+	}
+}
+
+static int intern_grow(void)
+{
+	intern_slot_t *old = table.slots;
+	size_t i, old_size = table.size;
+
+	table.size = old_size ? old_size * 2 : INTERN_MIN_SIZE;
+	table.slots = calloc(table.size, sizeof(intern_slot_t));
+	if (!table.slots) {
+		table.slots = old;
+		table.size = old_size;
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < old_size; i++)
+		if (old[i].str)
+			*intern_find(old[i].hash, old[i].str, old[i].len) = old[i];
+
+	free(old);
+	return 0;
+}
+
+static int intern_init(void)
+{
+	size_t i;
+
+	if (intern_grow())
+		return -ENOMEM;
+
+	for (i = 0; i < sizeof(well_known) / sizeof(well_known[0]); i++) {
+		intern_slot_t *slot;
+		size_t len = strlen(well_known[i]);
+		uint64_t hash = intern_hash(well_known[i], len);
+
+		slot = intern_find(hash, well_known[i], len);
+		slot->hash = hash;
+		slot->str = well_known[i];
+		slot->len = len;
+		table.count++;
+	}
+
+	return 0;
+}
+
+// note: table_mutex has to be held
+static const char *intern_locked(uint64_t hash, const char *str, size_t len)
+{
+	intern_slot_t *slot;
+	char *copy;
+
+	if (!table.slots && intern_init())
+		return NULL;
+
+	slot = intern_find(hash, str, len);
+	if (slot->str)
+		return slot->str;
+
+	// keep the load factor under 1/2
+	if ((table.count + 1) * 2 > table.size) {
+		if (intern_grow())
+			return NULL;
+
+		slot = intern_find(hash, str, len);
+	}
+
+	copy = arena_alloc(&table.arena, len + 1);
+	if (!copy)
+		return NULL;
+
+	memcpy(copy, str, len);
+	copy[len] = 0;
+
+	slot->hash = hash;
+	slot->str = copy;
+	slot->len = len;
+	table.count++;
+	return copy;
+}
+
+//RETURN VALUE
+//	the canonical copy of str, NULL if out of memory
+// note: str doesn't have to be NUL-terminated, the returned string is
+const char *intern(const char *str, size_t len)
+{
+	intern_slot_t *cached;
+	const char *rv;
+	uint64_t hash;
+
+	hash = intern_hash(str, len);
+
+	cached = cache + (hash & (INTERN_CACHE_SIZE - 1));
+	if (cached->str && cached->hash == hash && cached->len == len &&
+	    !memcmp(cached->str, str, len))
+		return cached->str;
+
+	pthread_mutex_lock(&table_mutex);
+	rv = intern_locked(hash, str, len);
+	pthread_mutex_unlock(&table_mutex);
+
+	if (rv) {
+		cached->hash = hash;
+		cached->str = rv;
+		cached->len = len;
+	}
+
+	return rv;
+}
+
+// note: this can only be called once all other threads are done with the
+// table, as their caches can't be cleared from here
+void intern_free(void)
+{
+	pthread_mutex_lock(&table_mutex);
+	free(table.slots);
+	arena_free(&table.arena);
+	memset(&table, 0, sizeof(table));
+	memset(cache, 0, sizeof(cache));
+	pthread_mutex_unlock(&table_mutex);
+}
@@ -18,32 +18,174 @@ Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
 
 #include "common.h"
 #include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-int lexer_open(lexer_state_t *ls, const char *path, vstr_t *token)
+//RETURN VALUES
+//	0 if the file was mapped
+//	1 if it can't be mapped (not a regular file, empty, compressed, etc.)
+static int map_file(lexer_state_t *ls, int fd)
 {
-	ls->error = 0;
-	ls->path = path;
+	struct stat st;
+	void *map;
+	char magic[4];
+	ssize_t ret;
 
-	ls->fp = fopen(path, "r");
-	if (!ls->fp)
-		return -errno;
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode) || st.st_size <= 0)
+		return 1;
 
-	ls->eof = false;
+	ret = pread(fd, magic, sizeof(magic), 0);
+	if (ret > 0 && compress_format(magic, ret))
+		return 1;
 
-	ls->token = token;
-	ls->buf_e = ls->buf_c = ls->buf;
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+		return 1;
+
+	// these are only hints, failing to apply them is harmless
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+	madvise(map, st.st_size, MADV_HUGEPAGE);
+#endif
+
+	ls->map = map;
+	ls->map_size = st.st_size;
+	ls->map_dev = st.st_dev;
+	ls->map_ino = st.st_ino;
+	return 0;
+}
+
+static void reset_state(lexer_state_t *ls, const char *path, vstr_t *token)
+{
+	ls->error = 0;
+	ls->path = path;
+	ls->fp = NULL;
+	ls->dec = NULL;
+	ls->map = NULL;
+	ls->map_size = 0;
+	ls->src = NULL;
+	ls->token_cc = 0;
+
+	ls->token = NULL;
+	ls->token_size = 0;
+	ls->token_buf = token;
+	ls->token_copied = false;
 	ls->cc = ls->lc = ls->Cc = 0;
+	ls->last = 0;
 
 	ls->in_token = false;
 	ls->in_quote = false;
 	ls->in_comment = false;
 
+	ls->token_kind = TOKEN_WORD;
+	ls->token_quoted = false;
+
+	ls->quiet = false;
+	ls->suppressed = false;
+	ls->partial = false;
+
+	ls->num_tokens = 0;
+	ls->num_floats = 0;
+}
+
+static int fill_buffer(lexer_state_t *ls);
+
+// a compressed input is recognized by its first buffer, which is handed
+// over to the decompressor
+//RETURN VALUE
+//	0 on success, 1 on error (errno is set)
+static int open_compressed(lexer_state_t *ls)
+{
+	int ret, format;
+
+	ret = fill_buffer(ls);
+	if (ret) {
+		errno = -ret;
+		return 1;
+	}
+
+	format = compress_format(ls->buf, ls->buf_e - ls->buf);
+	if (!format)
+		return 0;
+
+	ls->dec = decompress_open(ls->fp, ls->path, format, ls->buf,
+	                          ls->buf_e - ls->buf);
+	if (!ls->dec)
+		return 1;
+
+	ls->eof = false;
+	ls->buf_e = ls->buf_c = ls->buf;
 	return 0;
 }
 
+int lexer_open(lexer_state_t *ls, const char *path, vstr_t *token)
+{
+	int fd;
+
+	reset_state(ls, path, token);
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+
+	if (!map_file(ls, fd)) {
+		close(fd);
+
+		// the whole file is already "buffered"
+		ls->eof = true;
+		ls->buf_c = ls->src = ls->map;
+		ls->buf_e = ls->map + ls->map_size;
+	} else {
+		ls->fp = fdopen(fd, "r");
+		if (!ls->fp) {
+			close(fd);
+			return -errno;
+		}
+
+		ls->eof = false;
+		ls->buf_e = ls->buf_c = ls->buf;
+
+		if (open_compressed(ls)) {
+			int ret = -errno;
+
+			fclose(ls->fp);
+			ls->fp = NULL;
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+// lexes [buf + start->offs, buf + end) as if it was read from the middle of
+// the file at path (which buf is the contents of)
+void lexer_open_chunk(lexer_state_t *ls, const char *path, const char *buf,
+                      const lexer_split_t *start, size_t end, vstr_t *token)
+{
+	reset_state(ls, path, token);
+
+	ls->eof = true;
+	ls->src = buf;
+	ls->buf_c = buf + start->offs;
+	ls->buf_e = buf + end;
+
+	ls->cc = start->offs;
+	ls->lc = start->lc;
+	ls->Cc = start->Cc;
+	if (start->offs)
+		ls->last = buf[start->offs - 1];
+}
+
 void lexer_close(lexer_state_t *ls)
 {
-	fclose(ls->fp);
+	decompress_close(ls->dec);
+
+	if (ls->map)
+		munmap(ls->map, ls->map_size);
+	else if (ls->fp)
+		fclose(ls->fp);
 }
 
 //RETURN VALUES
@@ -54,10 +196,22 @@ static int fill_buffer(lexer_state_t *ls)
 {
 	size_t read;
 
-	read = fread(ls->buf, 1, sizeof(ls->buf), ls->fp);
+	if (ls->dec) {
+		ssize_t ret;
+
+		ret = decompress_read(ls->dec, ls->buf, sizeof(ls->buf));
+		if (ret < 0) {
+			ls->error = -ret;
+			return ret;
+		}
+
+		read = ret;
+	} else
+		read = fread(ls->buf, 1, sizeof(ls->buf), ls->fp);
+
 	debug("read = %zu\n", read);
 	if (read < sizeof(ls->buf)) {
-		if (ferror(ls->fp))
+		if (!ls->dec && ferror(ls->fp))
 			return -errno;
 
 		ls->eof = true;
@@ -69,6 +223,55 @@ static int fill_buffer(lexer_state_t *ls)
 	return 0;
 }
 
+// the bytes of a token are always contiguous in the input, so until a
+// refill (see lexer_get_token) it's enough to remember where it begins
+static inline int token_append(lexer_state_t *ls, const char *p, size_t len)
+{
+	if (ls->token_copied) {
+		if (vstr_putn(ls->token_buf, p, len))
+			return -ENOMEM;
+	} else if (!ls->token_size)
+		ls->token = p;
+
+	ls->token_size += len;
+	return 0;
+}
+
+//RETURN VALUES
+//	-ENOMEM
+//	0 on success
+// note: consumes the longest run of bytes that the state machine in
+// read_buffer would pass through without changing its state
+static int skip_run(lexer_state_t *ls)
+{
+	size_t run;
+
+	if (ls->in_comment)
+		run = scan_comment(ls->buf_c, ls->buf_e);
+	else if (ls->in_quote)
+		run = scan_quoted(ls->buf_c, ls->buf_e);
+	else if (ls->in_token)
+		run = scan_bare(ls->buf_c, ls->buf_e);
+	else
+		run = scan_space(ls->buf_c, ls->buf_e);
+
+	if (!run)
+		return 0;
+
+	if (!ls->in_comment && ls->in_quote)
+		ls->in_token = true;
+
+	if (!ls->in_comment && ls->in_token)
+		if (token_append(ls, ls->buf_c, run))
+			return -ENOMEM;
+
+	ls->last = ls->buf_c[run - 1];
+	ls->buf_c += run;
+	ls->cc += run;
+	ls->Cc += run;
+	return 0;
+}
+
 //RETURN VALUES
 //	-ENOMEM
 //	-EAGAIN when the buffer runs out
@@ -79,6 +282,14 @@ static int read_buffer(lexer_state_t *ls)
 	while (ls->buf_c < ls->buf_e) {
 		bool ret_token = false;
 
+		if (skip_run(ls)) {
+			ls->error = ENOMEM;
+			return -ENOMEM;
+		}
+
+		if (ls->buf_c == ls->buf_e)
+			break;
+
 		debug("*ls->buf_c = %c, ls->last = %c\n", *ls->buf_c, ls->last);
 
 		if (*ls->buf_c == '\n') {
@@ -98,12 +309,17 @@ static int read_buffer(lexer_state_t *ls)
 			ls->in_comment = true;
 			ls->in_token = false;
 
-			ls->token->size--; // remove the first slash
-			if (ls->token->size)
+			// remove the first slash
+			ls->token_size--;
+			if (ls->token_copied)
+				ls->token_buf->size--;
+
+			if (ls->token_size)
 				ret_token = true;
 		} else if (*ls->buf_c == '\"' &&
 		           (ls->cc && ls->last != '\\')) {
 			ls->in_quote = !ls->in_quote;
+			ls->token_quoted = true;
 
 			if (!ls->in_quote) {
 				ls->in_token = false;
@@ -112,11 +328,12 @@ static int read_buffer(lexer_state_t *ls)
 		} else {
 			if (!ls->in_token) {
 				ls->in_token = true;
+				ls->token_cc = ls->cc;
 			}
 		}
 
 		if (ls->in_token)
-			if (vstr_putc(ls->token, *ls->buf_c)) {
+			if (token_append(ls, ls->buf_c, 1)) {
 				ls->error = ENOMEM;
 				return -ENOMEM;
 			}
@@ -131,7 +348,7 @@ static int read_buffer(lexer_state_t *ls)
 	}
 
 	if (ls->eof) {
-		if (ls->token->size > 0)
+		if (ls->token_size > 0)
 			return 0;
 		return 1;
 	}
@@ -139,6 +356,60 @@ static int read_buffer(lexer_state_t *ls)
 	return -EAGAIN;
 }
 
+// what the kinds look like in the messages
+static const char *token_names[] = {
+	[TOKEN_WORD] = "a word",
+	[TOKEN_QUOTED] = "a quoted string",
+	[TOKEN_NUMBER] = "a number",
+	[TOKEN_LBRACE] = "{",
+	[TOKEN_RBRACE] = "}",
+	[TOKEN_LPAREN] = "(",
+	[TOKEN_RPAREN] = ")",
+	[TOKEN_PATCHDEF2] = "patchDef2"
+};
+
+static int classify_token(const lexer_state_t *ls)
+{
+	const char *p = ls->token;
+	size_t size = ls->token_size;
+
+	if (ls->token_quoted || !size)
+		return TOKEN_QUOTED;
+
+	if (size == 1) {
+		switch (*p) {
+		case '{':
+			return TOKEN_LBRACE;
+		case '}':
+			return TOKEN_RBRACE;
+		case '(':
+			return TOKEN_LPAREN;
+		case ')':
+			return TOKEN_RPAREN;
+		}
+	}
+
+	if (*p == '-' || *p == '+') {
+		p++;
+		size--;
+	}
+
+	if (size && *p == '.') {
+		p++;
+		size--;
+	}
+
+	if (size && *p >= '0' && *p <= '9')
+		return TOKEN_NUMBER;
+
+	if (ls->token_size == 9 && !memcmp(ls->token, "patchDef2", 9))
+		return TOKEN_PATCHDEF2;
+
+	return TOKEN_WORD;
+}
+
+// the token is left in ls->token and ls->token_size (it's not
+// NUL-terminated) and its kind in ls->token_kind
 //RETURN VALUES
 //	<0 on error
 //	0 on success
@@ -147,14 +418,34 @@ int lexer_get_token(lexer_state_t *ls)
 {
 	int ret;
 
-	vstr_clear(ls->token);
+	ls->token_size = 0;
+	ls->token_copied = false;
+	ls->token_quoted = false;
 
 	while (1) {
 		ret = read_buffer(ls);
 		debug("read_buffer = %i\n", ret);
+		if (!ret) {
+			if (ls->token_copied)
+				ls->token = ls->token_buf->data;
+
+			ls->token_kind = classify_token(ls);
+			ls->num_tokens++;
+		}
 		if (ret != -EAGAIN)
 			return ret;
 
+		// buf is about to be overwritten, keep what's in it
+		if (!ls->token_copied && ls->token_size) {
+			vstr_clear(ls->token_buf);
+			if (vstr_putn(ls->token_buf, ls->token, ls->token_size)) {
+				ls->error = ENOMEM;
+				return -ENOMEM;
+			}
+
+			ls->token_copied = true;
+		}
+
 		ret = fill_buffer(ls);
 		debug("fill_buffer = %i\n", ret);
 		if (ret < 0)
@@ -166,10 +457,15 @@ void lexer_perror(lexer_state_t *ls, const char *fmt, ...)
 {
 	va_list vl;
 
+	if (ls->quiet) {
+		ls->suppressed = true;
+		return;
+	}
+
 	fprintf(stderr, "%s:%zu:%zu: ", ls->path, ls->lc + 1, ls->Cc + 1);
 
 	if (ls->error) {
-		perror(NULL);
+		fprintf(stderr, "%s\n", strerror(ls->error));
 	} else {
 		va_start(vl, fmt);
 		vfprintf(stderr, fmt, vl);
@@ -181,11 +477,9 @@ void lexer_perror_eg(lexer_state_t *ls, const char *expected)
 {
 	if (ls->eof && ls->buf_c == ls->buf_e)
 		lexer_perror(ls, "expected %s, got EOF\n", expected);
-	else {
-		vstr_termz(ls->token);
-		lexer_perror(ls, "expected %s, got \"%s\"\n", expected,
-		             ls->token->data);
-	}
+	else
+		lexer_perror(ls, "expected %s, got \"%.*s\"\n", expected,
+		             (int)ls->token_size, ls->token);
 }
 
 int lexer_assert(lexer_state_t *ls, const char *match, const char *desc)
@@ -199,28 +493,54 @@ int lexer_assert(lexer_state_t *ls, const char *match, const char *desc)
 		return 1;
 	}
 
-	if (vstr_cmp(ls->token, match)) {
-		vstr_termz(ls->token);
-		lexer_perror(ls, "expected %s%s\"%s\", got \"%s\"\n",
+	if (ls->token_size != strlen(match) ||
+	    memcmp(ls->token, match, ls->token_size)) {
+		lexer_perror(ls, "expected %s%s\"%s\", got \"%.*s\"\n",
 		             (desc ? desc : ""), (desc ? " " : ""), match,
-		             ls->token->data);
+		             (int)ls->token_size, ls->token);
 		return 1;
 	}
 
 	return 0;
 } 
 
+// like lexer_assert, but goes by the token's kind
+int lexer_expect(lexer_state_t *ls, int kind, const char *desc)
+{
+	int ret;
+
+	ret = lexer_get_token(ls);
+	if (ret) {
+		lexer_perror(ls, "expected %s%s\"%s\", got EOF\n",
+		             (desc ? desc : ""), (desc ? " " : ""),
+		             token_names[kind]);
+		return 1;
+	}
+
+	if (ls->token_kind != kind) {
+		lexer_perror(ls, "expected %s%s\"%s\", got \"%.*s\"\n",
+		             (desc ? desc : ""), (desc ? " " : ""),
+		             token_names[kind], (int)ls->token_size,
+		             ls->token);
+		return 1;
+	}
+
+	return 0;
+}
+
 //RETURN VALUE
 //	-1 on eof (also success)
 //	0 on success
 //	1 on error
-int lexer_assert_or_eof(lexer_state_t *ls, const char *match, const char *desc)
+int lexer_expect_or_eof(lexer_state_t *ls, int kind, const char *desc)
 {
 	int ret;
 
 	ret = lexer_get_token(ls);
 	if (ret < 0) {
-		perror("lexer");
+		if (!ls->quiet)
+			perror("lexer");
+		ls->suppressed = true;
 		return 1;
 	}
 
@@ -228,28 +548,381 @@ int lexer_assert_or_eof(lexer_state_t *ls, const char *match, const char *desc)
 		return -1;
 	}
 
-	if (vstr_cmp(ls->token, match)) {
+	if (ls->token_kind != kind) {
 		lexer_perror(ls, "expected %s%s\"%s\" or EOF, got \"%.*s\"\n",
-		             (desc ? desc : ""), (desc ? " " : ""), match,
-		             (int)ls->token->size, ls->token->data);
+		             (desc ? desc : ""), (desc ? " " : ""),
+		             token_names[kind], (int)ls->token_size,
+		             ls->token);
 		return 1;
 	}
 
 	return 0;
 } 
 
+// keeps the position counters in sync for a single consumed byte
+static inline void advance(lexer_state_t *ls, char ch)
+{
+	if (ch == '\n') {
+		ls->lc++;
+		ls->Cc = 0;
+	}
+
+	ls->last = ch;
+	ls->cc++;
+	ls->Cc++;
+}
+
+//RETURN VALUES
+//	0 on success
+//	1 if the next token isn't a plain number that's entirely in the buffer
+// note: this reads the number straight from the buffer, without going
+// through read_buffer and the token. Nothing is consumed on failure.
+static int read_float(lexer_state_t *ls, float *out)
+{
+	const char *p, *s;
+	size_t len;
+
+	if (ls->in_token || ls->in_quote || ls->in_comment)
+		return 1;
+
+	for (p = ls->buf_c; p < ls->buf_e && isspace(*p); p++)
+		;
+
+	len = scan_bare(p, ls->buf_e);
+	if (!len || p + len == ls->buf_e || !isspace(p[len]))
+		return 1;
+
+	if (parse_float(p, len, out))
+		return 1;
+
+	// consume the leading whitespace, the number and its delimiter
+	for (s = ls->buf_c; s < p; s++)
+		advance(ls, *s);
+
+	ls->cc += len;
+	ls->Cc += len;
+	advance(ls, p[len]);
+
+	ls->buf_c = p + len + 1;
+	ls->token_kind = TOKEN_NUMBER;
+	ls->num_tokens++;
+	return 0;
+}
+
+// note: the numbers are converted in one pass over the buffer for as long
+// as they're plain decimals, the rest goes through lexer_get_token
 int lexer_get_floats(lexer_state_t *ls, float *out, size_t count)
 {
 	size_t i;
 
+	ls->num_floats += count;
+
 	for (i = 0; i < count; i++) {
+		if (!read_float(ls, out + i))
+			continue;
+
 		if (lexer_get_token(ls)) {
 			lexer_perror_eg(ls, "a number");
 			return 1;
 		}
 
-		out[i] = vstr_atof(ls->token);
+		out[i] = ls->token_size ?
+		         str_to_float(ls->token, ls->token_size) : 0;
 	}
 
 	return 0;
 }
+
+//
+// fast paths
+//
+
+// Recognizers for what makes up most of a map: face lines and patch rows.
+// They walk the buffer with a cursor of their own and only commit it if the
+// whole thing is there in its usual form (tokens separated by whitespace,
+// plain decimal numbers, no quotes or comments). Otherwise nothing is
+// consumed and the caller goes the generic way, which then gives the same
+// results and errors as if the fast path didn't exist.
+
+typedef struct {
+	const char *p, *e;
+	const char *newline; // the last one consumed, NULL if none
+	size_t lines;
+	const char *token; // the last one that's not a number
+	size_t token_size;
+} cursor_t;
+
+static inline bool cursor_init(cursor_t *c, const lexer_state_t *ls)
+{
+	if (ls->in_token || ls->in_quote || ls->in_comment)
+		return false;
+
+	c->p = ls->buf_c;
+	c->e = ls->buf_e;
+	c->newline = NULL;
+	c->lines = 0;
+	c->token = NULL;
+	c->token_size = 0;
+	return true;
+}
+
+static inline void cursor_newline(cursor_t *c, const char *p)
+{
+	c->newline = p;
+	c->lines++;
+}
+
+static inline void cursor_space(cursor_t *c)
+{
+	for (; c->p < c->e && isspace(*c->p); c->p++)
+		if (*c->p == '\n')
+			cursor_newline(c, c->p);
+}
+
+//RETURN VALUE
+//	the length of the next bare token that's delimited by whitespace,
+//	0 if there's no such token
+static inline size_t cursor_token(cursor_t *c)
+{
+	size_t len;
+
+	cursor_space(c);
+
+	len = scan_bare(c->p, c->e);
+	if (!len || c->p + len == c->e || !isspace(c->p[len]))
+		return 0;
+
+	return len;
+}
+
+// consumes the token and its delimiter
+static inline void cursor_skip(cursor_t *c, size_t len)
+{
+	c->p += len;
+
+	if (*c->p == '\n')
+		cursor_newline(c, c->p);
+
+	c->p++;
+}
+
+static inline bool cursor_char(cursor_t *c, char ch)
+{
+	if (cursor_token(c) != 1 || *c->p != ch)
+		return false;
+
+	c->token = c->p;
+	c->token_size = 1;
+	cursor_skip(c, 1);
+	return true;
+}
+
+static inline bool cursor_floats(cursor_t *c, float *out, size_t count)
+{
+	size_t i, len;
+
+	for (i = 0; i < count; i++) {
+		len = cursor_token(c);
+		if (!len || parse_float(c->p, len, out + i))
+			return false;
+
+		cursor_skip(c, len);
+	}
+
+	return true;
+}
+
+// a bare word, slashes are fine as long as they don't start a comment
+static inline bool cursor_word(cursor_t *c)
+{
+	const char *p;
+
+	cursor_space(c);
+	p = c->p + scan_bare(c->p, c->e);
+
+	while (p < c->e && *p == '/') {
+		if (p + 1 < c->e && p[1] == '/')
+			return false;
+
+		p++;
+		p += scan_bare(p, c->e);
+	}
+
+	if (p == c->p || p == c->e || !isspace(*p))
+		return false;
+
+	c->token = c->p;
+	c->token_size = p - c->p;
+	cursor_skip(c, p - c->p);
+	return true;
+}
+
+static void cursor_commit(lexer_state_t *ls, const cursor_t *c, int kind,
+                          size_t tokens, size_t floats)
+{
+	size_t len = c->p - ls->buf_c;
+
+	ls->token_cc = ls->cc + (c->token - ls->buf_c);
+	ls->token = c->token;
+	ls->token_size = c->token_size;
+	ls->token_copied = false;
+	ls->token_kind = kind;
+
+	if (c->lines) {
+		ls->lc += c->lines;
+		ls->Cc = c->p - c->newline;
+	} else
+		ls->Cc += len;
+
+	ls->cc += len;
+	ls->last = c->p[-1];
+	ls->buf_c = c->p;
+
+	ls->num_tokens += tokens;
+	ls->num_floats += floats;
+}
+
+// reads what follows the "(" of a face:
+// x y z ) ( x y z ) ( x y z ) shader s t r sx sy c f v
+//RETURN VALUES
+//	0 on success (the shader is left in ls->token)
+//	1 if it has to go the generic way, nothing is consumed then
+int lexer_read_face(lexer_state_t *ls, float *def, float *texmap)
+{
+	cursor_t c;
+
+	if (!cursor_init(&c, ls))
+		return 1;
+
+	if (!cursor_floats(&c, def, 3) ||
+	    !cursor_char(&c, ')') || !cursor_char(&c, '(') ||
+	    !cursor_floats(&c, def + 3, 3) ||
+	    !cursor_char(&c, ')') || !cursor_char(&c, '(') ||
+	    !cursor_floats(&c, def + 6, 3) ||
+	    !cursor_char(&c, ')') ||
+	    !cursor_word(&c) ||
+	    !cursor_floats(&c, texmap, 8))
+		return 1;
+
+	// 17 numbers, 5 parentheses and the shader
+	cursor_commit(ls, &c, TOKEN_NUMBER, 23, 17);
+	return 0;
+}
+
+// reads a whole row of a patch: ( ( x y z u v ) ( x y z u v ) ... )
+//RETURN VALUES
+//	0 on success
+//	1 if it has to go the generic way, nothing is consumed then
+int lexer_read_patch_row(lexer_state_t *ls, float *out, size_t count)
+{
+	cursor_t c;
+	size_t i;
+
+	if (!cursor_init(&c, ls) || !cursor_char(&c, '('))
+		return 1;
+
+	for (i = 0; i < count; i++)
+		if (!cursor_char(&c, '(') || !cursor_floats(&c, out + i * 5, 5) ||
+		    !cursor_char(&c, ')'))
+			return 1;
+
+	if (!cursor_char(&c, ')'))
+		return 1;
+
+	cursor_commit(ls, &c, TOKEN_RPAREN, count * 7 + 2, count * 5);
+	return 0;
+}
+
+//
+// splitting
+//
+
+// A quick pass over the whole file that finds the opening braces of
+// entities and brushes, following the same quote and comment rules as
+// read_buffer. Only braces that are tokens of their own count, but braces
+// in unusual places (e.g. as key names) can still fool it, so the caller
+// has to check that the chunks fit together.
+
+static bool is_token_end(const char *p, const char *e)
+{
+	return p == e || isspace(*p) || (*p == '/' && p + 1 < e && p[1] == '/');
+}
+
+//RETURN VALUE
+//	the number of splits written to splits
+// note: the chunks between the splits are at least chunk_size bytes long
+// (except for the last one), the beginning of the file isn't a split
+size_t lexer_find_splits(const char *buf, size_t size, size_t chunk_size,
+                         lexer_split_t *splits, size_t max_splits)
+{
+	const char *p = buf, *e = buf + size, *line = NULL;
+	const char *quote_end = NULL, *last_split = buf;
+	bool in_quote = false, in_comment = false;
+	size_t lc = 0, depth = 0, count = 0;
+
+	while (count < max_splits) {
+		if (in_comment)
+			p += scan_comment(p, e);
+		else if (in_quote)
+			p += scan_quoted(p, e);
+		else
+			p += scan_structure(p, e);
+
+		if (p == e)
+			break;
+
+		switch (*p) {
+		case '\n':
+			lc++;
+			line = p;
+			in_comment = false;
+			break;
+
+		case '/':
+			if (p > buf && p[-1] == '/')
+				in_comment = true;
+			break;
+
+		case '\"':
+			if (p > buf && p[-1] != '\\') {
+				in_quote = !in_quote;
+				if (!in_quote)
+					quote_end = p;
+			}
+			break;
+
+		case '{':
+		case '}':
+			if (in_quote)
+				break;
+
+			if (p > buf && !isspace(p[-1]) && p - 1 != quote_end)
+				break;
+
+			if (!is_token_end(p + 1, e))
+				break;
+
+			if (*p == '}') {
+				if (depth)
+					depth--;
+				break;
+			}
+
+			if (depth < 2 && p - last_split >= chunk_size) {
+				splits[count].offs = p - buf;
+				splits[count].lc = lc;
+				splits[count].Cc = line ? p - line : p - buf;
+				splits[count].in_entity = (depth == 1);
+				count++;
+				last_split = p;
+			}
+
+			depth++;
+			break;
+		}
+
+		p++;
+	}
+
+	return count;
+}
@@ -18,6 +18,8 @@ Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
 
 #include "common.h"
 #include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
 
 #define error(fmt, ...) fprintf(stderr, PROGRAM_NAME ": " fmt, ##__VA_ARGS__)
 
@@ -32,7 +34,11 @@ void print_version(void)
 void print_usage(void)
 {
 	puts(PROGRAM_NAME " " PROGRAM_VERSION "\n"
-	     "usage: " PROGRAM_NAME " [-q] -o outfile infile...\n"
+	     "usage: " PROGRAM_NAME " [-q] [-c] [-r] [-b] [-s] [-d] [-j jobs]\n"
+	     "           [-C cachedir [-L megabytes]] [--profile[=json]]\n"
+	     "           [--trace tracefile]\n"
+	     "           [--region minx miny minz maxx maxy maxz]\n"
+	     "           -o outfile infile...\n"
 	     "    or " PROGRAM_NAME " -v\n"
 	     "    or " PROGRAM_NAME " -h");
 }
@@ -40,15 +46,291 @@ void print_usage(void)
 typedef struct {
 	char *path;
 	elist_header_t list;
+
+	off_t size;
+	long jobs; // for map_read
+	const cache_t *cache; // NULL if it's not used
+	map_t map;
+	bool loaded; // map is read and postprocessed, but not merged yet
+	bool done, failed;
+	profile_t profile; // see --profile
 } input_file_t;
 
+// the input is read from path (which can be its cache entry)
+static void input_loaded(input_file_t *input, const char *path)
+{
+	struct stat st;
+
+	if (!stat(path, &st))
+		input->profile.bytes_read = st.st_size;
+
+	profile_add_map(&input->profile, &input->map);
+	input->loaded = true;
+}
+
+// reads and postprocesses a single input into input->map
+// note: when streaming, input->map is only left with the counters
+static int load_input(input_file_t *input, map_stream_t *stream)
+{
+	char *entry = NULL;
+	profile_clock_t clock;
+
+	map_init(&input->map);
+
+	// cache entries are already postprocessed. If one can't be read,
+	// the input is read instead (and the entry is replaced)
+	if (input->cache)
+		entry = cache_entry(input->cache, input->path);
+
+	if (entry && !cache_lookup(entry)) {
+		int ret;
+
+		profile_start(&clock);
+		ret = stream ? map_stream_read(stream, &input->map, entry) :
+		      map_read(&input->map, entry, 1);
+		profile_stop(&clock, &input->profile, PROFILE_READ,
+		             input->path);
+
+		if (!ret) {
+			input_loaded(input, entry);
+			free(entry);
+			return 0;
+		}
+
+		map_init(&input->map);
+	}
+
+	if (stream) {
+		free(entry);
+
+		profile_start(&clock);
+		if (map_stream_read(stream, &input->map, input->path)) {
+			error("error: couldn't read %s\n", input->path);
+			return 1;
+		}
+		profile_stop(&clock, &input->profile, PROFILE_READ,
+		             input->path);
+
+		input_loaded(input, input->path);
+		return 0;
+	}
+
+	profile_start(&clock);
+	if (map_read(&input->map, input->path, input->jobs)) {
+		error("error: couldn't read %s\n", input->path);
+		free(entry);
+		return 1;
+	}
+	profile_stop(&clock, &input->profile, PROFILE_READ,
+	             input->path);
+
+	profile_start(&clock);
+	if (map_postprocess(&input->map)) {
+		map_free(&input->map);
+		free(entry);
+		return 1;
+	}
+	profile_stop(&clock, &input->profile, PROFILE_POSTPROCESS,
+	             input->path);
+
+	// the output doesn't depend on the cache, so failing to update it
+	// isn't an error
+	if (entry && cache_store(input->cache, &input->map, entry))
+		error("warning: couldn't cache %s\n", input->path);
+
+	free(entry);
+	input_loaded(input, input->path);
+	return 0;
+}
+
+// prints the --profile report
+static void print_profiles(const input_file_t *inputs, const char *output,
+                           const profile_t *total, bool json)
+{
+	const input_file_t *input;
+
+	if (!json) {
+		elist_cfor(input, inputs, list)
+			profile_print(input->path, &input->profile);
+
+		profile_print(output, total);
+		return;
+	}
+
+	printf("{\"inputs\": [");
+
+	elist_cfor(input, inputs, list) {
+		printf(input == inputs ? "\n" : ",\n");
+		profile_print_json(input->path, &input->profile);
+	}
+
+	printf("\n], \"total\": ");
+	profile_print_json(output, total);
+	printf("}\n");
+}
+
+//
+// worker pool (-j)
+//
+
+// Inputs are loaded by the workers largest first, so that a big input
+// picked last doesn't hold up the whole run. The main thread merges them
+// in command line order as they become available, which keeps the output
+// identical to a serial run.
+
+typedef struct {
+	input_file_t **queue;
+	size_t num_queued, next;
+	bool abort;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+
+	pthread_t *threads;
+	size_t num_threads;
+} pool_t;
+
+static void *pool_worker(void *arg)
+{
+	pool_t *pool = arg;
+
+	while (1) {
+		input_file_t *input;
+		bool failed;
+
+		pthread_mutex_lock(&pool->mutex);
+		if (pool->abort || pool->next == pool->num_queued) {
+			pthread_mutex_unlock(&pool->mutex);
+			break;
+		}
+		input = pool->queue[pool->next++];
+		pthread_mutex_unlock(&pool->mutex);
+
+		failed = load_input(input, NULL);
+
+		pthread_mutex_lock(&pool->mutex);
+		input->failed = failed;
+		input->done = true;
+		pthread_cond_broadcast(&pool->cond);
+		pthread_mutex_unlock(&pool->mutex);
+	}
+
+	return NULL;
+}
+
+static int compare_sizes(const void *a, const void *b)
+{
+	const input_file_t *ia = *(input_file_t**)a, *ib = *(input_file_t**)b;
+
+	if (ia->size != ib->size)
+		return ia->size < ib->size ? 1 : -1;
+
+	return 0;
+}
+
+static int pool_start(pool_t *pool, input_file_t *inputs, size_t jobs)
+{
+	input_file_t *input;
+	size_t count = 0, workers, i;
+	off_t total = 0;
+	int ret;
+
+	memset(pool, 0, sizeof(*pool));
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+
+	elist_for(input, inputs, list)
+		count++;
+
+	pool->queue = malloc(count * sizeof(input_file_t*));
+	pool->threads = malloc(jobs * sizeof(pthread_t));
+	if (!pool->queue || !pool->threads)
+		return -ENOMEM;
+
+	elist_for(input, inputs, list) {
+		struct stat st;
+
+		// unreadable files are reported by map_read later
+		input->size = stat(input->path, &st) ? 0 : st.st_size;
+		pool->queue[pool->num_queued++] = input;
+		total += input->size;
+	}
+
+	qsort(pool->queue, pool->num_queued, sizeof(input_file_t*),
+	      compare_sizes);
+
+	workers = jobs < count ? jobs : count;
+
+	// the jobs that don't get a worker are shared out among the inputs
+	// by size, a big input would hold everything up otherwise. An input
+	// with more than one is split (see map_read), its reader counts as
+	// one of them, so there are never more than jobs threads reading.
+	if (total)
+		elist_for(input, inputs, list)
+			input->jobs = 1 + (jobs - workers) * input->size /
+			                  total;
+
+	// fewer workers than asked for will do, but not none
+	for (i = 0; i < workers; i++) {
+		ret = pthread_create(pool->threads + i, NULL, pool_worker, pool);
+		if (ret)
+			return pool->num_threads ? 0 : -ret;
+
+		pool->num_threads++;
+	}
+
+	return 0;
+}
+
+static void pool_wait(pool_t *pool, input_file_t *input)
+{
+	pthread_mutex_lock(&pool->mutex);
+	while (!input->done)
+		pthread_cond_wait(&pool->cond, &pool->mutex);
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+// note: inputs that haven't been picked up yet are skipped
+static void pool_stop(pool_t *pool)
+{
+	size_t i;
+
+	pthread_mutex_lock(&pool->mutex);
+	pool->abort = true;
+	pthread_mutex_unlock(&pool->mutex);
+
+	for (i = 0; i < pool->num_threads; i++)
+		pthread_join(pool->threads[i], NULL);
+
+	free(pool->queue);
+	free(pool->threads);
+	pthread_mutex_destroy(&pool->mutex);
+	pthread_cond_destroy(&pool->cond);
+}
+
 int main(int argc, char **argv)
 {
-	int rv = 1, i;
+	int rv = 1, i, flags = 0, format;
 	input_file_t *inputs = NULL, *input, *next;
 	char *output = NULL;
-	bool read_flags = true, quiet = false;
+	bool read_flags = true, quiet = false, map_ready = false;
+	long jobs = 1;
 	map_t map;
+	pool_t pool;
+	bool pool_running = false;
+	map_stream_t stream;
+	bool streaming = false, stream_open = false;
+	bool dedupe = false;
+	bool region = false;
+	float region_mins[3], region_maxs[3];
+	char *cache_dir = NULL;
+	long cache_size = 0;
+	cache_t cache;
+	bool profile = false, profile_json = false;
+	char *trace = NULL;
+	profile_t total;
+	profile_clock_t clock;
+	struct stat st;
 
 	for (i = 1; i < argc; i++) {
 		if (read_flags && !strcmp(argv[i], "-v")) {
@@ -61,6 +343,104 @@ int main(int argc, char **argv)
 			goto out;
 		} else if (read_flags && !strcmp(argv[i], "-q")) {
 			quiet = true;
+		} else if (read_flags && !strcmp(argv[i], "-c")) {
+			flags |= MAPCAT_COMPACT;
+		} else if (read_flags && !strcmp(argv[i], "-r")) {
+			flags |= MAPCAT_REFORMAT;
+		} else if (read_flags && !strcmp(argv[i], "-b")) {
+			flags |= MAPCAT_BINARY;
+		} else if (read_flags && !strcmp(argv[i], "-s")) {
+			streaming = true;
+		} else if (read_flags && !strcmp(argv[i], "-d")) {
+			dedupe = true;
+		} else if (read_flags && !strcmp(argv[i], "--profile")) {
+			profile = true;
+		} else if (read_flags && !strcmp(argv[i], "--profile=json")) {
+			profile = profile_json = true;
+		} else if (read_flags && !strcmp(argv[i], "-j")) {
+			char *end;
+
+			if (i + 1 >= argc) {
+				error("-j needs an argument\n");
+				goto out;
+			}
+
+			// -j 0 means one job per CPU
+			jobs = strtol(argv[i + 1], &end, 10);
+			if (*end || end == argv[i + 1] || jobs < 0) {
+				error("-j needs a number of jobs\n");
+				goto out;
+			}
+
+			if (!jobs)
+				jobs = sysconf(_SC_NPROCESSORS_ONLN);
+			if (jobs < 1)
+				jobs = 1;
+
+			i++;
+		} else if (read_flags && !strcmp(argv[i], "-C")) {
+			if (i + 1 >= argc) {
+				error("-C needs an argument\n");
+				goto out;
+			}
+
+			cache_dir = argv[i + 1];
+			i++;
+		} else if (read_flags && !strcmp(argv[i], "-L")) {
+			char *end;
+
+			if (i + 1 >= argc) {
+				error("-L needs an argument\n");
+				goto out;
+			}
+
+			cache_size = strtol(argv[i + 1], &end, 10);
+			if (*end || end == argv[i + 1] || cache_size < 1) {
+				error("-L needs a size in megabytes\n");
+				goto out;
+			}
+
+			i++;
+		} else if (read_flags && !strcmp(argv[i], "--trace")) {
+			if (i + 1 >= argc) {
+				error("--trace needs an argument\n");
+				goto out;
+			}
+
+			trace = argv[i + 1];
+			i++;
+		} else if (read_flags && !strcmp(argv[i], "--region")) {
+			float box[6];
+			int j;
+
+			if (i + 6 >= argc) {
+				error("--region needs 6 arguments\n");
+				goto out;
+			}
+
+			for (j = 0; j < 6; j++) {
+				char *end;
+
+				box[j] = strtof(argv[i + 1 + j], &end);
+				if (*end || end == argv[i + 1 + j]) {
+					error("--region needs 6 numbers\n");
+					goto out;
+				}
+			}
+
+			for (j = 0; j < 3; j++) {
+				region_mins[j] = box[j];
+				region_maxs[j] = box[3 + j];
+
+				if (region_mins[j] > region_maxs[j]) {
+					error("--region's mins can't be "
+					      "greater than its maxs\n");
+					goto out;
+				}
+			}
+
+			region = true;
+			i += 6;
 		} else if (read_flags && !strcmp(argv[i], "-o")) {
 			if (i + 1 >= argc) {
 			o_needs_an_argument:
@@ -91,7 +471,9 @@ int main(int argc, char **argv)
 				goto out;
 			}
 
+			memset(input, 0, sizeof(*input));
 			input->path = argv[i];
+			input->jobs = 1;
 			elist_append(&inputs, input, list);
 		}
 	}
@@ -106,52 +488,183 @@ int main(int argc, char **argv)
 		goto out;
 	}
 
-	map_init(&map);
+	// stdout has to be nothing but the JSON report
+	if (profile_json)
+		quiet = true;
 
-	elist_for(input, inputs, list) {
-		map_t part;
+	// the binary format can't be written as it goes
+	if (streaming && (flags & MAPCAT_BINARY)) {
+		error("-s can't be used with -b\n");
+		goto out;
+	}
 
-		map_init(&part);
+	// nothing is kept around to compare with
+	if (streaming && dedupe) {
+		error("-s can't be used with -d\n");
+		goto out;
+	}
 
-		if (map_read(&part, input->path)) {
-			error("error: couldn't read %s\n", input->path);
+	if (streaming && region) {
+		error("-s can't be used with --region\n");
+		goto out;
+	}
+
+	// outputs named *.gz and *.zst are compressed
+	format = compress_format_of(output);
+	if (format && (flags & MAPCAT_BINARY)) {
+		error("-b can't be used with a compressed output\n");
+		goto out;
+	}
+
+	if (!compress_available(format)) {
+		error("%s: built without %s support\n", output,
+		      compress_name(format));
+		goto out;
+	}
+
+	if (cache_dir) {
+		cache_init(&cache, cache_dir, flags);
+		if (cache_size)
+			cache.max_size = (uint64_t)cache_size * 1024 * 1024;
+
+		elist_for(input, inputs, list)
+			input->cache = &cache;
+	}
+
+	if (trace && trace_open(trace))
+		goto out;
+
+	map_init(&map);
+	map_ready = true;
+	memset(&total, 0, sizeof(total));
+
+	// inputs are streamed one at a time, so -j doesn't apply
+	if (streaming) {
+		if (map_stream_open(&stream, output, flags))
 			goto out;
-		}
 
-		if (map_postprocess(&part)) {
-			map_free(&map);
-			map_free(&part);
+		stream_open = true;
+	} else if (jobs > 1) {
+		if (pool_start(&pool, inputs, jobs)) {
+			error("error: couldn't start the worker threads\n");
+			pool_stop(&pool);
 			goto out;
 		}
 
+		pool_running = true;
+	}
+
+	elist_for(input, inputs, list) {
+		if (pool_running)
+			pool_wait(&pool, input);
+		else
+			input->failed = load_input(input, stream_open ?
+			                            &stream : NULL);
+
+		if (input->failed)
+			goto out;
+
 		if (!quiet)
-			map_print_stats(input->path, &part);
+			map_print_stats(input->path, &input->map);
 
-		if (map_merge(&map, &part)) {
+		profile_start(&clock);
+		if (map_merge(&map, &input->map)) {
 			error("error: couldn't merge %s into %s\n",
 			      input->path, output);
-			map_free(&map);
-			map_free(&part);
 			goto out;
 		}
+		profile_stop(&clock, &input->profile, PROFILE_MERGE,
+		             input->path);
+
+		input->loaded = false;
+		profile_add(&total, &input->profile);
+
+		trace_counter("bytes read", total.bytes_read);
+		trace_rss();
+	}
+
+	if (pool_running) {
+		pool_stop(&pool);
+		pool_running = false;
+	}
+
+	if (dedupe) {
+		double start = trace_begin();
+
+		if (map_dedupe(&map))
+			goto out;
+
+		trace_end(start, "map_dedupe", output, 0);
+	}
+
+	if (region) {
+		double start = trace_begin();
+
+		if (map_region(&map, region_mins, region_maxs))
+			goto out;
+
+		trace_end(start, "map_region", output, 0);
 	}
 
 	if (!quiet)
 		map_print_stats(output, &map);
 
-	if (map_write(&map, output)) {
+	profile_start(&clock);
+
+	if (stream_open) {
+		stream_open = false;
+
+		if (map_stream_close(&stream)) {
+			error("error: couldn't write %s\n", output);
+			goto out;
+		}
+	} else if (map_write(&map, output, flags, jobs)) {
 		error("error: couldn't write %s\n", output);
-		map_free(&map);
 		goto out;
 	}
 
-	map_free(&map);
+	profile_stop(&clock, &total, PROFILE_WRITE, output);
+
+	// the size of a pipe and such isn't known
+	if (!stat(output, &st) && S_ISREG(st.st_mode))
+		total.bytes_written = st.st_size;
+
+	trace_counter("bytes written", total.bytes_written);
+	trace_rss();
+
+	if (profile) {
+		profile_finish(&total);
+		print_profiles(inputs, output, &total, profile_json);
+	}
+
+	if (cache_dir && cache_trim(&cache))
+		error("warning: couldn't trim the cache\n");
+
 	rv = 0;
 out:
+	if (pool_running)
+		pool_stop(&pool);
+
+	// the timeline is written even if something failed
+	if (trace_close(trace))
+		error("warning: couldn't write %s\n", trace);
+
+	if (stream_open)
+		map_stream_abort(&stream);
+
+	if (map_ready)
+		map_free(&map);
+
 	for (input = inputs; input; input = next) {
 		next = elist_next(input, list);
+
+		if (input->loaded)
+			map_free(&input->map);
+
 		free(input);
 	}
 
+	intern_free();
+
 	return rv;
 }
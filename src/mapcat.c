@@ -18,82 +18,36 @@ Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
 
 #define DEBUG
 #include "common.h"
-
-//
-// freeing
-//
-
-static void free_entity_keys(entity_t *entity)
-{
-	entity_key_t *key, *next;
-
-	for (key = entity->keys; key; key = next) {
-		next = elist_next(key, list);
-
-		free(key->key);
-		free(key->value);
-		free(key);
-	}
-}
-
-static void free_brush(brush_t *brush)
-{
-	brush_face_t *face, *face_next;
-
-	if (brush->patch) {
-		free(brush->patch->shader);
-		free(brush->patch->def);
-		free(brush->patch);
-	} else {
-		for (face = brush->faces; face; face = face_next) {
-			face_next = elist_next(face, list);
-
-			free(face->shader);
-			free(face);
-		}
-	}
-
-	free(brush);
-}
-
-// this frees an entity_t and its children
-static void free_entity(entity_t *entity)
-{
-	brush_t *brush, *next;
-
-	free_entity_keys(entity);
-	free(entity->classname);
-
-	for (brush = entity->brushes; brush; brush = next) {
-		next = elist_next(brush, list);
-		free_brush(brush);
-	}
-
-	free(entity);
-}
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 //
 // reading
 //
 
-static int read_entity_key(lexer_state_t *ls, entity_t *entity)
+static int read_entity_key(lexer_state_t *ls, map_t *map, entity_t *entity)
 {
 	entity_key_t *key;
+	const char *name;
+
+	name = intern(ls->token, ls->token_size);
+	if (!name)
+		goto error_oom;
 
 	// classnames are stored separately for easier access later
-	if (!vstr_cmp(ls->token, "classname")) {
-		if (entity->classname) {
+	if (name == intern_classname) {
+		if (entity->classname)
 			lexer_perror(ls, "warning: duplicate classname\n");
-			free(entity->classname);
-			entity->classname = NULL;
-		}
 
 		if (lexer_get_token(ls)) {
 			lexer_perror_eg(ls, "the classname");
 			return 1;
 		}
 
-		entity->classname = vstr_strdup(ls->token);
+		entity->classname = intern(ls->token, ls->token_size);
 		if (!entity->classname) {
 			lexer_perror(ls, "out of memory\n");
 			return 1;
@@ -102,7 +56,7 @@ static int read_entity_key(lexer_state_t *ls, entity_t *entity)
 		return 0;
 	}
 
-	if (!vstr_cmp(ls->token, "mapcat_discard")) {
+	if (name == intern_mapcat_discard) {
 		entity->discard = true;
 
 		// make sure to read (and forget) the value
@@ -112,16 +66,14 @@ static int read_entity_key(lexer_state_t *ls, entity_t *entity)
 		return 0;
 	}
 
-	key = malloc(sizeof(entity_key_t));
+	key = arena_alloc(&map->arena, sizeof(entity_key_t));
 	if (!key)
 		goto error_oom;
 
 	memset(key, 0, sizeof(*key));
 	elist_append(&entity->keys, key, list);
 
-	key->key = vstr_strdup(ls->token);
-	if (!key->key)
-		goto error_oom;
+	key->key = name;
 
 	if (lexer_get_token(ls)) {
 	expected_key_value:
@@ -129,7 +81,7 @@ static int read_entity_key(lexer_state_t *ls, entity_t *entity)
 		return 1;
 	}
 
-	key->value = vstr_strdup(ls->token);
+	key->value = arena_strndup(&map->arena, ls->token, ls->token_size);
 	if (!key->value)
 		goto error_oom;
 
@@ -139,41 +91,135 @@ error_oom:
 	return 1;
 }
 
-static int read_brush_face(lexer_state_t *ls, brush_t *brush)
+#define FACE_BLOCK_MIN 64
+#define FACE_BLOCK_MAX 4096
+
+static face_block_t *new_face_block(map_t *map, size_t alloc)
+{
+	face_block_t *block;
+
+	block = arena_alloc(&map->arena, sizeof(face_block_t));
+	if (!block)
+		return NULL;
+
+	block->count = 0;
+	block->alloc = alloc;
+	block->def = arena_alloc(&map->arena, alloc * sizeof(block->def[0]));
+	block->shader = arena_alloc(&map->arena,
+	                            alloc * sizeof(block->shader[0]));
+	block->texmap = arena_alloc(&map->arena,
+	                            alloc * sizeof(block->texmap[0]));
+	if (!block->def || !block->shader || !block->texmap)
+		return NULL;
+
+	return block;
+}
+
+//RETURN VALUE
+//	the index of the new face in brush->block, -1 on error
+static ssize_t add_face(lexer_state_t *ls, map_t *map, brush_t *brush)
 {
-	brush_face_t *face;
+	face_block_t *block = map->face_block, *old;
+	size_t alloc;
+
+	if (block && block->count < block->alloc)
+		goto add;
+
+	// blocks grow with the map, so small maps don't waste much memory
+	alloc = block ? block->alloc * 2 : FACE_BLOCK_MIN;
+	if (alloc > FACE_BLOCK_MAX)
+		alloc = FACE_BLOCK_MAX;
+
+	// but a brush with more faces than that still has to fit
+	if (alloc < (brush->num_faces + 1) * 2)
+		alloc = (brush->num_faces + 1) * 2;
 
-	face = malloc(sizeof(brush_face_t));
-	if (!face) {
+	old = block;
+	block = new_face_block(map, alloc);
+	if (!block) {
 		lexer_perror(ls, "out of memory\n");
-		return 1;
+		return -1;
+	}
+
+	// a brush can't straddle two blocks, move its faces to the new one
+	if (brush->num_faces) {
+		size_t n = brush->num_faces, first = brush->first_face;
+
+		memcpy(block->def, old->def + first, n * sizeof(old->def[0]));
+		memcpy(block->shader, old->shader + first,
+		       n * sizeof(old->shader[0]));
+		memcpy(block->texmap, old->texmap + first,
+		       n * sizeof(old->texmap[0]));
+
+		old->count -= n;
+		block->count = n;
+		brush->block = block;
+		brush->first_face = 0;
+	}
+
+	map->face_block = block;
+
+add:
+	if (!brush->num_faces) {
+		brush->block = block;
+		brush->first_face = block->count;
 	}
 
-	memset(face, 0, sizeof(*face));
-	elist_append(&brush->faces, face, list);
+	brush->num_faces++;
+	return block->count++;
+}
+
+// note: brush has to be the last brush that was read
+static void drop_faces(map_t *map, brush_t *brush)
+{
+	if (brush->num_faces && brush->block == map->face_block)
+		map->face_block->count = brush->first_face;
+}
+
+static int read_brush_face(lexer_state_t *ls, map_t *map, brush_t *brush)
+{
+	ssize_t i;
+	float *def, *texmap;
+
+	i = add_face(ls, map, brush);
+	if (i < 0)
+		return 1;
 
-	if (lexer_get_floats(ls, face->def, 3))
+	def = brush->block->def[i];
+	texmap = brush->block->texmap[i];
+	brush->block->shader[i] = NULL;
+
+	// most faces are read in one go, the rest go token by token below
+	if (!lexer_read_face(ls, def, texmap)) {
+		brush->block->shader[i] = intern(ls->token, ls->token_size);
+		if (!brush->block->shader[i])
+			goto error_oom;
+
+		return 0;
+	}
+
+	if (lexer_get_floats(ls, def, 3))
 		return 1;
 
-	if (lexer_assert(ls, ")", "the end of this face's 1st vector"))
+	if (lexer_expect(ls, TOKEN_RPAREN, "the end of this face's 1st vector"))
 		return 1;
 
-	if (lexer_assert(ls, "(", "the beginning of this face's 2nd vector"))
+	if (lexer_expect(ls, TOKEN_LPAREN, "the beginning of this face's 2nd vector"))
 		return 1;
 
-	if (lexer_get_floats(ls, face->def + 3, 3))
+	if (lexer_get_floats(ls, def + 3, 3))
 		return 1;
 
-	if (lexer_assert(ls, ")", "the end of this face's 2nd vector"))
+	if (lexer_expect(ls, TOKEN_RPAREN, "the end of this face's 2nd vector"))
 		return 1;
 
-	if (lexer_assert(ls, "(", "the beginning of this face's 3rd vector"))
+	if (lexer_expect(ls, TOKEN_LPAREN, "the beginning of this face's 3rd vector"))
 		return 1;
 
-	if (lexer_get_floats(ls, face->def + 6, 3))
+	if (lexer_get_floats(ls, def + 6, 3))
 		return 1;
 
-	if (lexer_assert(ls, ")", "the end of this face's 3rd vector"))
+	if (lexer_expect(ls, TOKEN_RPAREN, "the end of this face's 3rd vector"))
 		return 1;
 
 	if (lexer_get_token(ls)) {
@@ -181,16 +227,17 @@ static int read_brush_face(lexer_state_t *ls, brush_t *brush)
 		return 1;
 	}
 
-	face->shader = vstr_strdup(ls->token);
-	if (!face->shader) {
-		lexer_perror(ls, "out of memory\n");
-		return 1;
-	}
+	brush->block->shader[i] = intern(ls->token, ls->token_size);
+	if (!brush->block->shader[i])
+		goto error_oom;
 
-	if (lexer_get_floats(ls, face->texmap, 8))
+	if (lexer_get_floats(ls, texmap, 8))
 		return 1;
 
 	return 0;
+error_oom:
+	lexer_perror(ls, "out of memory\n");
+	return 1;
 }
 
 static int read_brush_patch_points(lexer_state_t *ls, brush_patch_t *patch)
@@ -198,36 +245,41 @@ static int read_brush_patch_points(lexer_state_t *ls, brush_patch_t *patch)
 	size_t y, x;
 
 	for (y = 0; y < patch->yres; y++) {
-		if (lexer_assert(ls, "(", "the beginning of a patch row"))
+		// see read_brush_face
+		if (!lexer_read_patch_row(ls, patch->def + y * patch->xres * 5,
+		                          patch->xres))
+			continue;
+
+		if (lexer_expect(ls, TOKEN_LPAREN, "the beginning of a patch row"))
 			return 1;
 
 		for (x = 0; x < patch->xres; x++) {
 			size_t offs;
 
-			if (lexer_assert(ls, "(", "the beginning of a patch cell"))
+			if (lexer_expect(ls, TOKEN_LPAREN, "the beginning of a patch cell"))
 				return 1;
 
 			offs = (y * patch->xres + x) * 5;
 			if (lexer_get_floats(ls, patch->def + offs, 5))
 				return 1;
 
-			if (lexer_assert(ls, ")", "the end of a patch cell"))
+			if (lexer_expect(ls, TOKEN_RPAREN, "the end of a patch cell"))
 				return 1;
 		}
 
-		if (lexer_assert(ls, ")", "the end of a patch row"))
+		if (lexer_expect(ls, TOKEN_RPAREN, "the end of a patch row"))
 			return 1;
 	}
 
 	return 0;
 }
 
-static int read_brush_patch(lexer_state_t *ls, brush_t *brush)
+static int read_brush_patch(lexer_state_t *ls, map_t *map, brush_t *brush)
 {
-	if (lexer_assert(ls, "{", NULL))
+	if (lexer_expect(ls, TOKEN_LBRACE, NULL))
 		return 1;
 
-	brush->patch = malloc(sizeof(brush_patch_t));
+	brush->patch = arena_alloc(&map->arena, sizeof(brush_patch_t));
 	if (!brush->patch) {
 		lexer_perror(ls, "out of memory\n");
 		return 1;
@@ -240,29 +292,30 @@ static int read_brush_patch(lexer_state_t *ls, brush_t *brush)
 		return 1;
 	}
 
-	brush->patch->shader = vstr_strdup(ls->token);
+	brush->patch->shader = intern(ls->token, ls->token_size);
 	if (!brush->patch->shader) {
 		lexer_perror_eg(ls, "out of memory\n");
 		return 1;
 	}
 
-	if (lexer_assert(ls, "(", NULL))
+	if (lexer_expect(ls, TOKEN_LPAREN, NULL))
 		return 1;
 
 	if (lexer_get_token(ls)) {
 		lexer_perror_eg(ls, "this patch's Y resolution");
 		return 1;
 	}
-	brush->patch->yres = vstr_atoz(ls->token);
+	brush->patch->yres = str_to_size(ls->token, ls->token_size);
 
 	if (lexer_get_token(ls)) {
 		lexer_perror_eg(ls, "this patch's X resolution");
 		return 1;
 	}
-	brush->patch->xres = vstr_atoz(ls->token);
+	brush->patch->xres = str_to_size(ls->token, ls->token_size);
 
-	brush->patch->def = malloc(sizeof(float) * brush->patch->xres *
-	                           brush->patch->yres * 5);
+	brush->patch->def = arena_alloc(&map->arena, sizeof(float) *
+	                                brush->patch->xres *
+	                                brush->patch->yres * 5);
 	if (!brush->patch->def) {
 		lexer_perror(ls, "out of memory\n");
 		return 1;
@@ -271,23 +324,23 @@ static int read_brush_patch(lexer_state_t *ls, brush_t *brush)
 	if (lexer_assert(ls, "0", NULL) ||
 	    lexer_assert(ls, "0", NULL) ||
 	    lexer_assert(ls, "0", NULL) ||
-	    lexer_assert(ls, ")", "the end of this patch's header") ||
-	    lexer_assert(ls, "(", "the beginning of this patch's points"))
+	    lexer_expect(ls, TOKEN_RPAREN, "the end of this patch's header") ||
+	    lexer_expect(ls, TOKEN_LPAREN, "the beginning of this patch's points"))
 		return 1;
 
 	if (read_brush_patch_points(ls, brush->patch))
 		return 1;
 
-	if (lexer_assert(ls, ")", "the end of this patch"))
+	if (lexer_expect(ls, TOKEN_RPAREN, "the end of this patch"))
 		return 1;
 
-	if (lexer_assert(ls, "}", "the end of this brush"))
+	if (lexer_expect(ls, TOKEN_RBRACE, "the end of this brush"))
 		return 1;
 
 	return 0;
 }
 
-static int read_brush_faces(lexer_state_t *ls, brush_t *brush)
+static int read_brush_faces(lexer_state_t *ls, map_t *map, brush_t *brush)
 {
 	while (1) {
 		if (lexer_get_token(ls)) {
@@ -299,130 +352,236 @@ static int read_brush_faces(lexer_state_t *ls, brush_t *brush)
 			return 1;
 		}
 
-		if (!vstr_cmp(ls->token, "(")) {
-			if (read_brush_face(ls, brush))
+		switch (ls->token_kind) {
+		case TOKEN_LPAREN:
+			if (read_brush_face(ls, map, brush))
 				return 1;
-		} else if (!vstr_cmp(ls->token, "}"))
 			break;
-		else if (!vstr_cmp(ls->token, "patchDef2")) {
-			if (read_brush_patch(ls, brush))
+		case TOKEN_RBRACE:
+			return 0;
+		case TOKEN_PATCHDEF2:
+			if (read_brush_patch(ls, map, brush))
 				return 1;
-		} else
+			break;
+		default:
 			goto bad_token;
+		}
 	}
-
-	return 0;
 }
 
 static bool brush_discard(brush_t *brush)
 {
-	brush_face_t *face;
+	size_t i;
 
 	if (brush->patch)
-		return !strcmp(brush->patch->shader, MAPCAT_DISCARD_SHADER);
+		return brush->patch->shader == intern_discard_shader;
 
-	elist_for(face, brush->faces, list)
-		if (!strcmp(face->shader, MAPCAT_DISCARD_SHADER))
+	for (i = 0; i < brush->num_faces; i++)
+		if (brush->block->shader[brush->first_face + i] ==
+		    intern_discard_shader)
 			return true;
 
 	return false;
 }
 
-static int read_entity(lexer_state_t *ls, map_t *map)
+// frees everything in map, but keeps its memory for reuse
+static void map_clear(map_t *map)
+{
+	arena_t arena = map->arena;
+	map_stream_t *stream = map->stream;
+
+	arena_reset(&arena);
+	memset(map, 0, sizeof(*map));
+	map->arena = arena;
+	map->stream = stream;
+}
+
+static void map_add_counters(map_t *master, const map_t *slave)
+{
+	master->num_entities += slave->num_entities;
+	master->num_discarded_entities += slave->num_discarded_entities;
+	master->num_brushes += slave->num_brushes;
+	master->num_discarded_brushes += slave->num_discarded_brushes;
+	master->num_patches += slave->num_patches;
+	master->num_discarded_patches += slave->num_discarded_patches;
+	master->num_duplicate_entities += slave->num_duplicate_entities;
+	master->num_duplicate_brushes += slave->num_duplicate_brushes;
+	master->num_duplicate_patches += slave->num_duplicate_patches;
+	master->num_tokens += slave->num_tokens;
+	master->num_floats += slave->num_floats;
+}
+
+static void stream_brush(map_stream_t *stream, const entity_t *entity,
+                         const brush_t *brush);
+
+// return values of read_entity_body and read_entity_brushes
+#define ENTITY_CLOSED 0
+#define ENTITY_ERROR 1
+#define ENTITY_OPEN 2 // EOF was reached in a partial buffer (see map_read)
+
+static entity_t *new_entity(lexer_state_t *ls, map_t *map)
 {
 	entity_t *entity;
 
-	entity = malloc(sizeof(entity_t));
+	entity = arena_alloc(&map->arena, sizeof(entity_t));
 	if (!entity) {
 		lexer_perror(ls, "out of memory\n");
-		return 1;
+		return NULL;
 	}
 
 	memset(entity, 0, sizeof(*entity));
+	return entity;
+}
 
-	// read keys and values
-	while (1) {
-		if (lexer_get_token(ls)) {
-			lexer_perror_eg(ls, "a key or the beginning of a brush"
-			                    " \"{\" or the end of this entity"
-			                    " \"}\"");
-			goto error;
-		}
-
-		if (!vstr_cmp(ls->token, "{"))
-			break;
-
-		if (!vstr_cmp(ls->token, "}"))
-			goto no_brushes;
-
-		if (read_entity_key(ls, entity))
-			goto error;
-	}
+static int read_entity_brushes(lexer_state_t *ls, map_t *map, entity_t *entity,
+                               bool first_brace_read)
+{
+	int ret;
+	map_t *target;
+	size_t start;
 
-	// the opening brace of the first brush in this entity was already
-	// read in the loop above, so it has to be skipped in the loop below.
+	// the opening brace of the first brush in this entity might have been
+	// read already, in which case it has to be skipped in the loop below.
 	// the problem is solved by jumping in the middle of the loop
-	goto skip_first_brace;
+	if (first_brace_read)
+		goto skip_first_brace;
 
 	while (1) {
 		brush_t *brush;
 
-		if (lexer_get_token(ls)) {
+		ret = lexer_get_token(ls);
+		if (ret) {
+			if (ret == 1 && ls->partial)
+				return ENTITY_OPEN;
 		L1:
 			lexer_perror_eg(ls, "the beginning of a brush \"{\""
 			                    " or the end of this entity \"}\"");
-			goto error;
+			return ENTITY_ERROR;
 		}
 
-		if (!vstr_cmp(ls->token, "}"))
+		if (ls->token_kind == TOKEN_RBRACE)
 			break;
-		else if (vstr_cmp(ls->token, "{"))
+		else if (ls->token_kind != TOKEN_LBRACE)
 			goto L1;
 
 	skip_first_brace:
-		brush = malloc(sizeof(brush_t));
+		// when streaming, worldspawn brushes are written out as soon as
+		// they're read and don't stay in memory
+		target = map;
+		if (map->stream && entity->classname == intern_worldspawn &&
+		    !entity->discard)
+			target = &map->stream->brush;
+
+		brush = arena_alloc(&target->arena, sizeof(brush_t));
 		if (!brush) {
 			lexer_perror(ls, "out of memory\n");
-			goto error;
+			return ENTITY_ERROR;
 		}
 
 		memset(brush, 0, sizeof(*brush));
+		start = ls->token_cc;
 
-		if (read_brush_faces(ls, brush)) {
-			free_brush(brush);
-			goto error;
+		if (read_brush_faces(ls, target, brush))
+			return ENTITY_ERROR;
+
+		// the closing brace was the last token
+		if (ls->src) {
+			brush->src = ls->src + start;
+			brush->src_len = ls->token_cc + 1 - start;
 		}
 
+		// note: discarded brushes stay in the arena until map_free,
+		// only their faces are reclaimed
 		if (brush_discard(brush)) {
+			drop_faces(target, brush);
+			entity->modified = true;
+
 			if (brush->patch)
 				map->num_discarded_patches++;
 			else
 				map->num_discarded_brushes++;
-
-			free_brush(brush);
 		} else {
-			elist_append(&entity->brushes, brush, list);
+			if (target != map)
+				stream_brush(map->stream, entity, brush);
+			else
+				elist_append(&entity->brushes, brush, list);
 
 			if (brush->patch)
 				map->num_patches++;
 			else
 				map->num_brushes++;
 		}
+
+		if (target != map)
+			map_clear(target);
+	}
+
+	return ENTITY_CLOSED;
+}
+
+// reads everything after the opening brace of an entity
+static int read_entity_body(lexer_state_t *ls, map_t *map, entity_t *entity)
+{
+	int ret;
+	double start = trace_begin();
+	size_t start_cc = ls->cc;
+
+	// the opening brace was the last token. If the entity doesn't end in
+	// this chunk, its length is filled in by stitch_chunks
+	if (ls->src)
+		entity->src = ls->src + ls->token_cc;
+
+	// read keys and values
+	while (1) {
+		ret = lexer_get_token(ls);
+		if (ret) {
+			if (ret == 1 && ls->partial)
+				return ENTITY_OPEN;
+
+			lexer_perror_eg(ls, "a key or the beginning of a brush"
+			                    " \"{\" or the end of this entity"
+			                    " \"}\"");
+			return ENTITY_ERROR;
+		}
+
+		if (ls->token_kind == TOKEN_LBRACE)
+			break;
+
+		if (ls->token_kind == TOKEN_RBRACE)
+			goto closed;
+
+		if (read_entity_key(ls, map, entity))
+			return ENTITY_ERROR;
 	}
 
-no_brushes:
+	ret = read_entity_brushes(ls, map, entity, true);
+	if (ret != ENTITY_CLOSED)
+		return ret;
+
+closed:
+	// the closing brace was the last token
+	if (ls->src)
+		entity->src_len = ls->src + ls->token_cc + 1 - entity->src;
+
+	if (ls->cc - start_cc >= TRACE_ENTITY_MIN)
+		trace_end(start, "entity", NULL, ls->cc - start_cc);
+
+	return ENTITY_CLOSED;
+}
+
+//RETURN VALUES
+//	0 on success
+//	1 if entity is a worldspawn and map already has one
+static int add_entity(map_t *map, entity_t *entity)
+{
 	if (entity->discard) {
 		map->num_discarded_entities++;
-		free_entity(entity);
 		return 0;
 	}
 
-	if (!strcmp(entity->classname, "worldspawn")) {
-		if (map->worldspawn) {
-			lexer_perror(ls, "this entity is a worldspawn, but a "
-			                 "worldspawn was already read earlier");
-			goto error;
-		}
+	if (entity->classname == intern_worldspawn) {
+		if (map->worldspawn)
+			return 1;
 
 		map->worldspawn = entity;
 	} else {
@@ -431,273 +590,1312 @@ no_brushes:
 	}
 
 	return 0;
-error:
-	free_entity(entity);
-	return 1;
+}
+
+static int read_entity(lexer_state_t *ls, map_t *map)
+{
+	entity_t *entity;
+
+	entity = new_entity(ls, map);
+	if (!entity)
+		return 1;
+
+	if (read_entity_body(ls, map, entity) != ENTITY_CLOSED)
+		return 1;
+
+	if (add_entity(map, entity)) {
+		lexer_perror(ls, "this entity is a worldspawn, but a "
+		                 "worldspawn was already read earlier");
+		return 1;
+	}
+
+	return 0;
 }
 
 //
-// writing
+// parallel reading
 //
 
-static int write_brush_patch(FILE *fp, const brush_patch_t *patch)
+// Big files are split into chunks at the opening braces of entities and
+// brushes (see lexer_find_splits) and the chunks are parsed concurrently.
+// A chunk can begin in the middle of an entity (with its brushes) and end
+// in the middle of another one, these pieces are stitched together in
+// order afterwards.
+//
+// The chunks are parsed quietly. If any of them fails, produces a warning
+// or doesn't fit with its neighbours, the results are thrown away and the
+// whole file is parsed again serially, which reports the problem (with the
+// right position) exactly like it would without the splitting.
+
+#define CHUNK_MIN_SIZE (1024 * 1024)
+#define CHUNKS_PER_JOB 4
+
+typedef struct {
+	lexer_split_t start;
+	size_t end;
+	bool last;
+
+	map_t map; // the entities that begin and end in this chunk
+	entity_t *head; // brushes of an entity that began in an earlier chunk
+	bool head_closed; // ... and whether it ends in this chunk
+	const char *head_end; // right after its closing brace
+	entity_t *tail; // an entity that goes on in the next chunk
+	bool failed;
+} chunk_t;
+
+typedef struct {
+	const char *path, *buf;
+	chunk_t *chunks;
+	size_t num_chunks, next;
+} chunk_job_t;
+
+static int read_chunk(lexer_state_t *ls, chunk_t *chunk)
 {
-	size_t y, x, i;
+	entity_t *entity;
+	int ret;
 
-	fprintf(fp, "patchDef2\n{\n%s\n( %zu %zu 0 0 0 )\n(\n",
-	        patch->shader, patch->yres, patch->xres);
+	if (chunk->start.in_entity) {
+		chunk->head = new_entity(ls, &chunk->map);
+		if (!chunk->head)
+			return 1;
 
-	for (y = 0; y < patch->yres; y++) {
-		fprintf(fp, "(");
+		ret = read_entity_brushes(ls, &chunk->map, chunk->head, false);
+		if (ret == ENTITY_ERROR)
+			return 1;
+		if (ret == ENTITY_OPEN)
+			return 0;
 
-		for (x = 0; x < patch->xres; x++) {
-			size_t offs = (y * patch->xres + x) * 5;
+		chunk->head_closed = true;
+		chunk->head_end = ls->src + ls->token_cc + 1;
+	}
+
+	while (1) {
+		ret = lexer_expect_or_eof(ls, TOKEN_LBRACE,
+		                          "the beginning of an entity");
+		if (ret == -1)
+			break;
+		if (ret > 0)
+			return 1;
+
+		entity = new_entity(ls, &chunk->map);
+		if (!entity)
+			return 1;
 
-			fprintf(fp, " (");
-			for (i = 0; i < 5; i++)
-				fprintf(fp, " %f", patch->def[offs + i]);
-			fprintf(fp, " )");
+		ret = read_entity_body(ls, &chunk->map, entity);
+		if (ret == ENTITY_ERROR)
+			return 1;
+		if (ret == ENTITY_OPEN) {
+			chunk->tail = entity;
+			break;
 		}
 
-		fprintf(fp, " )\n");
+		if (add_entity(&chunk->map, entity))
+			return 1;
 	}
 
-	fprintf(fp, ")\n}\n");
-
 	return 0;
 }
 
-static int write_brush(FILE *fp, const brush_t *brush)
+static void *chunk_worker(void *arg)
 {
-	const brush_face_t *face;
+	chunk_job_t *job = arg;
+	vstr_t token;
 
-	if (brush->patch)
-		return write_brush_patch(fp, brush->patch);
+	vstr_init(&token);
 
-	elist_cfor(face, brush->faces, list) {
+	while (1) {
+		lexer_state_t ls;
+		chunk_t *chunk;
 		size_t i;
+		double start;
 
-		for (i = 0; i < 9; i += 3) {
-			if (i)
-				fprintf(fp, " ");
-
-			fprintf(fp, "( %f %f %f )", face->def[i],
-			        face->def[i + 1], face->def[i + 2]);
-		}
-
-		fprintf(fp, " %s", face->shader);
-
-		for (i = 0; i < 5; i++)
-			fprintf(fp, " %f", face->texmap[i]);
-
-		// the last three values are integers
-		for (i = 5; i < 8; i++)
-			fprintf(fp, " %.0f", face->texmap[i]);
+		i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+		if (i >= job->num_chunks)
+			break;
 
-		fprintf(fp, "\n");
+		chunk = job->chunks + i;
+		start = trace_begin();
+		lexer_open_chunk(&ls, job->path, job->buf, &chunk->start,
+		                 chunk->end, &token);
+		ls.quiet = true;
+		ls.partial = !chunk->last;
+
+		chunk->failed = read_chunk(&ls, chunk) || ls.suppressed;
+		trace_end(start, "read_chunk", job->path,
+		          chunk->end - chunk->start.offs);
+		chunk->map.num_tokens = ls.num_tokens;
+		chunk->map.num_floats = ls.num_floats;
+		lexer_close(&ls);
 	}
 
-	if (ferror(fp))
-		return -errno;
-
-	return 0;
+	vstr_free(&token);
+	return NULL;
 }
 
-static int write_entity(FILE *fp, const entity_t *entity)
+static int stitch_chunks(map_t *map, chunk_t *chunks, size_t num_chunks)
 {
-	const entity_key_t *key;
-	const brush_t *brush;
-	size_t brush_counter = 0;
+	entity_t *open = NULL;
+	size_t i;
 
-	if (entity->classname)
-		fprintf(fp, "\"classname\" \"%s\"\n", entity->classname);
+	for (i = 0; i < num_chunks; i++) {
+		chunk_t *chunk = chunks + i;
 
-	elist_cfor(key, entity->keys, list)
-		fprintf(fp, "\"%s\" \"%s\"\n", key->key, key->value);
+		if (chunk->failed || chunk->start.in_entity != !!open)
+			return 1;
 
-	elist_cfor(brush, entity->brushes, list) {
-		fprintf(fp, "// brush %zu\n{\n", brush_counter);
-		write_brush(fp, brush);
-		fprintf(fp, "}\n");
-		brush_counter++;
-	}
+		if (chunk->head) {
+			elist_append_list(&open->brushes, chunk->head->brushes,
+			                  list);
+			open->modified |= chunk->head->modified;
 
-	if (ferror(fp))
-		return -errno;
+			if (chunk->head_closed) {
+				open->src_len = chunk->head_end - open->src;
 
-	return 0;
-}
+				if (add_entity(map, open))
+					return 1;
 
-//
-// entry points
-//
+				open = NULL;
+			}
+		}
 
-void map_init(map_t *map)
-{
-	memset(map, 0, sizeof(*map));
-}
+		if (chunk->map.worldspawn) {
+			if (map->worldspawn)
+				return 1;
 
-void map_free(map_t *map)
-{
-	entity_t *entity, *next;
+			map->worldspawn = chunk->map.worldspawn;
+		}
 
-	if (map->worldspawn)
-		free_entity(map->worldspawn);
+		elist_append_list(&map->entities, chunk->map.entities, list);
+		map_add_counters(map, &chunk->map);
+
+		arena_adopt(&map->arena, &chunk->map.arena);
 
-	for (entity = map->entities; entity; entity = next) {
-		next = elist_next(entity, list);
-		free_entity(entity);
+		if (chunk->tail)
+			open = chunk->tail;
 	}
+
+	return open ? 1 : 0;
 }
 
-int map_read(map_t *map, const char *path)
+//RETURN VALUES
+//	0 on success
+//	1 if the file has to be read serially
+static int read_parallel(map_t *map, const char *path, const char *buf,
+                         size_t size, int jobs)
 {
 	int rv = 1;
-	lexer_state_t lexer;
-	vstr_t token;
+	size_t chunk_size, max_splits, i, num_threads;
+	lexer_split_t *splits = NULL;
+	chunk_job_t job;
+	pthread_t *threads = NULL;
+
+	memset(&job, 0, sizeof(job));
+
+	chunk_size = size / ((size_t)jobs * CHUNKS_PER_JOB);
+	if (chunk_size < CHUNK_MIN_SIZE)
+		chunk_size = CHUNK_MIN_SIZE;
+
+	max_splits = size / chunk_size + 1;
+	splits = malloc(max_splits * sizeof(lexer_split_t));
+	job.chunks = calloc(max_splits + 1, sizeof(chunk_t));
+	threads = malloc(jobs * sizeof(pthread_t));
+	if (!splits || !job.chunks || !threads)
+		goto out;
 
-	vstr_init(&token);
+	job.num_chunks = lexer_find_splits(buf, size, chunk_size, splits,
+	                                   max_splits) + 1;
+	if (job.num_chunks < 2)
+		goto out;
 
-	if (lexer_open(&lexer, path, &token)) {
-		perror(path);
-		return 1;
-	}
+	job.path = path;
+	job.buf = buf;
 
-	while (1) {
-		int ret;
+	for (i = 0; i < job.num_chunks; i++) {
+		chunk_t *chunk = job.chunks + i;
 
-		ret = lexer_assert_or_eof(&lexer, "{",
-		                          "the beginning of an entity");
-		if (ret == -1)
+		if (i)
+			chunk->start = splits[i - 1];
+		chunk->end = (i + 1 < job.num_chunks ? splits[i].offs : size);
+		chunk->last = (i + 1 == job.num_chunks);
+		map_init(&chunk->map);
+	}
+
+	// the calling thread is the last of the jobs
+	for (num_threads = 0; num_threads + 1 < (size_t)jobs &&
+	     num_threads + 1 < job.num_chunks; num_threads++)
+		if (pthread_create(threads + num_threads, NULL, chunk_worker,
+		                   &job))
 			break;
-		if (ret > 0)
-			goto out;
 
-		if (read_entity(&lexer, map))
-			goto out;
-	}
+	chunk_worker(&job);
 
-	rv = 0;
-out:
-	vstr_free(&token);
-	lexer_close(&lexer);
+	for (i = 0; i < num_threads; i++)
+		pthread_join(threads[i], NULL);
 
+	rv = stitch_chunks(map, job.chunks, job.num_chunks);
 	if (rv)
 		map_free(map);
 
+out:
+	if (job.chunks)
+		for (i = 0; i < job.num_chunks; i++)
+			map_free(&job.chunks[i].map);
+
+	free(splits);
+	free(job.chunks);
+	free(threads);
 	return rv;
 }
 
-int map_write(const map_t *map, const char *path)
-{
-	int rv = 1;
-	FILE *fp;
-	const entity_t *entity;
-	size_t entity_counter = 1; // worldspawn is #0
+//
+// writing
+//
 
-	fp = fopen(path, "w");
-	if (!fp) {
-		perror(path);
-		goto out;
+// formats count floats into buf, each preceded by a space
+static char *put_floats(char *buf, const float *v, size_t count, int flags)
+{
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		*(buf++) = ' ';
+		if (flags & MAPCAT_COMPACT)
+			buf += format_float_short(buf, v[i]);
+		else
+			buf += format_float_fixed(buf, v[i], 6);
 	}
 
-	if (!map->worldspawn) {
-		fprintf(stderr, "error: worldspawn is missing\n");
-		goto out;
-	}
+	return buf;
+}
+
+// writes "text" followed by a decimal number and "\n"
+static void put_counter(output_t *out, const char *text, size_t n)
+{
+	size_t len = strlen(text);
+	char *p;
+
+	p = output_reserve(out, len + FLOAT_BUFFER + 1);
+	memcpy(p, text, len);
+	len += format_size(p + len, n);
+	p[len++] = '\n';
+	output_commit(out, len);
+}
+
+static void write_brush_patch(output_t *out, const brush_patch_t *patch,
+                              int flags)
+{
+	size_t y, x;
+	char *buf, *p;
+
+	output_puts(out, "patchDef2\n{\n");
+	output_puts(out, patch->shader);
+
+	p = buf = output_reserve(out, 2 * FLOAT_BUFFER + 32);
+	memcpy(p, "\n( ", 3);
+	p += 3 + format_size(p + 3, patch->yres);
+	*(p++) = ' ';
+	p += format_size(p, patch->xres);
+	memcpy(p, " 0 0 0 )\n(\n", 11);
+	output_commit(out, p + 11 - buf);
+
+	for (y = 0; y < patch->yres; y++) {
+		output_put(out, "(", 1);
+
+		for (x = 0; x < patch->xres; x++) {
+			size_t offs = (y * patch->xres + x) * 5;
+
+			p = buf = output_reserve(out, 5 * (FLOAT_BUFFER + 1) + 8);
+			memcpy(p, " (", 2);
+			p = put_floats(p + 2, patch->def + offs, 5, flags);
+			memcpy(p, " )", 2);
+			output_commit(out, p + 2 - buf);
+		}
+
+		output_put(out, " )\n", 3);
+	}
+
+	output_put(out, ")\n}\n", 4);
+}
+
+static void write_brush(output_t *out, const brush_t *brush, int flags)
+{
+	const face_block_t *block = brush->block;
+	size_t f;
+	char *buf, *p;
+
+	if (brush->patch) {
+		write_brush_patch(out, brush->patch, flags);
+		return;
+	}
+
+	for (f = brush->first_face; f < brush->first_face + brush->num_faces;
+	     f++) {
+		size_t i;
+
+		p = buf = output_reserve(out, 9 * (FLOAT_BUFFER + 1) + 16);
+		for (i = 0; i < 9; i += 3) {
+			if (i)
+				*(p++) = ' ';
+
+			*(p++) = '(';
+			p = put_floats(p, block->def[f] + i, 3, flags);
+			memcpy(p, " )", 2);
+			p += 2;
+		}
+
+		*(p++) = ' ';
+		output_commit(out, p - buf);
+		output_puts(out, block->shader[f]);
+
+		p = buf = output_reserve(out, 8 * (FLOAT_BUFFER + 1) + 1);
+		p = put_floats(p, block->texmap[f], 5, flags);
+
+		// the last three values are integers
+		for (i = 5; i < 8; i++) {
+			*(p++) = ' ';
+			p += format_float_fixed(p, block->texmap[f][i], 0);
+		}
+
+		*(p++) = '\n';
+		output_commit(out, p - buf);
+	}
+}
+
+// brushes and entities are copied from the inputs as they are, unless they
+// were changed or the output has to be formatted anyway
+static bool copy_verbatim(const char *src, int flags)
+{
+	return src && !(flags & (MAPCAT_COMPACT | MAPCAT_REFORMAT));
+}
+
+// writes src followed by a newline
+static void write_verbatim(output_t *out, const char *src, size_t len)
+{
+	output_put(out, src, len);
+	output_put(out, "\n", 1);
+}
+
+static void write_key(output_t *out, const char *key, const char *prefix,
+                      const char *value)
+{
+	output_put(out, "\"", 1);
+	output_puts(out, key);
+	output_put(out, "\" \"", 3);
+	if (prefix)
+		output_puts(out, prefix);
+	output_puts(out, value);
+	output_put(out, "\"\n", 2);
+}
+
+static void write_brush_braced(output_t *out, const brush_t *brush,
+                               int flags)
+{
+	if (copy_verbatim(brush->src, flags)) {
+		write_verbatim(out, brush->src, brush->src_len);
+		return;
+	}
+
+	output_put(out, "{\n", 2);
+	write_brush(out, brush, flags);
+	output_put(out, "}\n", 2);
+}
+
+static void write_entity_keys(output_t *out, const entity_t *entity)
+{
+	const entity_key_t *key;
+
+	if (entity->classname)
+		write_key(out, intern_classname, NULL, entity->classname);
+
+	elist_cfor(key, entity->keys, list)
+		write_key(out, key->key, key->prefix, key->value);
+}
+
+// writes up to count brushes, starting with brush, numbered from counter
+static void write_brushes(output_t *out, const brush_t *brush, size_t count,
+                          size_t counter, int flags)
+{
+	for (; brush && count; brush = elist_cnext(brush, list), count--) {
+		if (!(flags & MAPCAT_COMPACT))
+			put_counter(out, "// brush ", counter);
 
-	fprintf(fp, "// entity 0\n{\n");
-	write_entity(fp, map->worldspawn);
-	fprintf(fp, "}\n");
+		write_brush_braced(out, brush, flags);
+		counter++;
+	}
+}
+
+static void write_entity(output_t *out, const entity_t *entity, int flags)
+{
+	write_entity_keys(out, entity);
+	write_brushes(out, entity->brushes, SIZE_MAX, 0, flags);
+}
+
+// like write_entity, but with the braces
+static void write_entity_braced(output_t *out, const entity_t *entity,
+                                int flags)
+{
+	if (!entity->modified && copy_verbatim(entity->src, flags)) {
+		write_verbatim(out, entity->src, entity->src_len);
+		return;
+	}
+
+	output_put(out, "{\n", 2);
+	write_entity(out, entity, flags);
+	output_put(out, "}\n", 2);
+}
+
+// writes up to count entities, starting with entity, numbered from counter
+static void write_entities(output_t *out, const entity_t *entity,
+                           size_t count, size_t counter, int flags)
+{
+	for (; entity && count; entity = elist_cnext(entity, list), count--) {
+		if (!(flags & MAPCAT_COMPACT))
+			put_counter(out, "// entity ", counter);
+
+		write_entity_braced(out, entity, flags);
+		counter++;
+	}
+}
+
+//
+// parallel writing
+//
+
+// The output is cut into units: the worldspawn's keys, runs of its brushes
+// and runs of the other entities. Every unit knows the numbers of its first
+// brush or entity, so the units can be formatted independently of each
+// other. They're formatted concurrently into per-thread buffers, a round at
+// a time to keep the memory bounded. Once a round is formatted, a prefix
+// sum of the units' lengths gives each one its offset in the output and
+// the threads pwrite their own units there. The result is exactly what the
+// serial writer produces.
+//
+// An output that can't be written at an offset (a pipe, etc.) is written
+// by the main thread alone, unit by unit, in order.
+
+#define UNIT_BRUSHES 256 // per unit, at most (roughly, for entities)
+#define UNIT_ENTITIES 64
+#define UNITS_PER_JOB 16 // in a round
+#define WRITE_MIN_UNITS 8 // smaller maps are written serially
+
+// write_unit_t types
+#define UNIT_KEYS 0 // of the worldspawn
+#define UNIT_BRUSHES_RUN 1 // of the worldspawn
+#define UNIT_ENTITIES_RUN 2
+
+typedef struct {
+	int type;
+	const entity_t *entity; // the first one
+	const brush_t *brush; // ditto
+	size_t count, counter; // of brushes or entities, and the first's number
+	bool close; // the closing brace of the worldspawn follows
+
+	// filled in while it's being written
+	size_t thread, offs, len; // where in which thread's buffer
+	off_t pos; // in the output
+} write_unit_t;
+
+// like pthread_barrier_t, but the number of threads can be lowered
+// before anyone's through
+typedef struct {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	size_t count, waiting, generation;
+} barrier_t;
+
+typedef struct write_job_s write_job_t;
+
+typedef struct {
+	write_job_t *job;
+	size_t index; // 0 is the main thread
+	pthread_t thread;
+	output_t out;
+	vstr_t mem;
+	int error; // errno
+} write_thread_t;
+
+struct write_job_s {
+	const map_t *map;
+	int flags, fd;
+	bool seekable;
+
+	write_unit_t *units;
+	size_t num_units;
+	size_t first, end, next; // the units of the current round
+	bool done;
+
+	barrier_t barrier;
+	write_thread_t *threads;
+	size_t num_threads;
+};
+
+static void barrier_wait(barrier_t *barrier)
+{
+	size_t generation;
+
+	pthread_mutex_lock(&barrier->mutex);
+
+	generation = barrier->generation;
+	if (++barrier->waiting == barrier->count) {
+		barrier->waiting = 0;
+		barrier->generation++;
+		pthread_cond_broadcast(&barrier->cond);
+	} else {
+		while (generation == barrier->generation)
+			pthread_cond_wait(&barrier->cond, &barrier->mutex);
+	}
+
+	pthread_mutex_unlock(&barrier->mutex);
+}
+
+static void barrier_set_count(barrier_t *barrier, size_t count)
+{
+	pthread_mutex_lock(&barrier->mutex);
+	barrier->count = count;
+	pthread_mutex_unlock(&barrier->mutex);
+}
+
+// fills in units (if it's not NULL)
+//RETURN VALUE
+//	the number of units
+static size_t cut_units(const map_t *map, write_unit_t *units)
+{
+	size_t num_units = 0, counter = 0, weight = 0;
+	write_unit_t unit;
+	const brush_t *brush;
+	const entity_t *entity;
+
+#define ADD_UNIT() \
+	do { \
+		if (units) \
+			units[num_units] = unit; \
+		num_units++; \
+	} while (0)
+
+	memset(&unit, 0, sizeof(unit));
+	unit.type = UNIT_KEYS;
+	unit.entity = map->worldspawn;
+	unit.close = !map->worldspawn->brushes;
+	ADD_UNIT();
+
+	elist_cfor(brush, map->worldspawn->brushes, list) {
+		if (counter % UNIT_BRUSHES == 0) {
+			memset(&unit, 0, sizeof(unit));
+			unit.type = UNIT_BRUSHES_RUN;
+			unit.brush = brush;
+			unit.count = UNIT_BRUSHES;
+			unit.counter = counter;
+			ADD_UNIT();
+		}
+
+		counter++;
+	}
+
+	if (units && counter)
+		units[num_units - 1].close = true;
+
+	memset(&unit, 0, sizeof(unit));
+	counter = 1; // worldspawn is #0
 
 	elist_cfor(entity, map->entities, list) {
-		fprintf(fp, "// entity %zu\n{\n", entity_counter);
+		size_t entity_weight = 1;
 
-		if (write_entity(fp, entity)) {
-			perror(path);
-			goto out;
+		elist_cfor(brush, entity->brushes, list)
+			entity_weight++;
+
+		if (unit.count && (unit.count == UNIT_ENTITIES ||
+		                   weight + entity_weight > UNIT_BRUSHES)) {
+			ADD_UNIT();
+			unit.count = 0;
 		}
-	 
-		fprintf(fp, "}\n");
-		entity_counter++;
+
+		if (!unit.count) {
+			unit.type = UNIT_ENTITIES_RUN;
+			unit.entity = entity;
+			unit.counter = counter;
+			weight = 0;
+		}
+
+		unit.count++;
+		weight += entity_weight;
+		counter++;
 	}
 
-	if (ferror(fp) || fclose(fp)) {
-		perror(path);
+	if (unit.count)
+		ADD_UNIT();
+
+#undef ADD_UNIT
+
+	return num_units;
+}
+
+static void format_unit(output_t *out, const write_unit_t *unit, int flags)
+{
+	switch (unit->type) {
+	case UNIT_KEYS:
+		if (!(flags & MAPCAT_COMPACT))
+			output_puts(out, "// entity 0\n");
+
+		output_put(out, "{\n", 2);
+		write_entity_keys(out, unit->entity);
+		break;
+
+	case UNIT_BRUSHES_RUN:
+		write_brushes(out, unit->brush, unit->count, unit->counter,
+		              flags);
+		break;
+
+	case UNIT_ENTITIES_RUN:
+		write_entities(out, unit->entity, unit->count, unit->counter,
+		               flags);
+		break;
+	}
+
+	if (unit->close)
+		output_put(out, "}\n", 2);
+}
+
+static void format_units(write_thread_t *thread)
+{
+	write_job_t *job = thread->job;
+
+	vstr_clear(&thread->mem);
+	output_init_mem(&thread->out, &thread->mem);
+
+	while (!thread->error) {
+		write_unit_t *unit;
+		size_t i;
+
+		i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+		if (i >= job->end)
+			break;
+
+		unit = job->units + i;
+		unit->thread = thread->index;
+		unit->offs = thread->mem.size;
+		format_unit(&thread->out, unit, job->flags);
+		thread->error = -output_flush(&thread->out);
+		unit->len = thread->mem.size - unit->offs;
+	}
+}
+
+// writes at pos, or at the current position if pos is negative
+//RETURN VALUE
+//	0 on success, errno on failure
+static int write_at(int fd, const char *data, size_t size, off_t pos)
+{
+	while (size) {
+		ssize_t ret;
+
+		if (pos < 0)
+			ret = write(fd, data, size);
+		else
+			ret = pwrite(fd, data, size, pos);
+
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return errno;
+		}
+
+		data += ret;
+		size -= ret;
+		if (pos >= 0)
+			pos += ret;
+	}
+
+	return 0;
+}
+
+// writes the thread's own units of the round (or all of them, in order, if
+// the output isn't seekable)
+static void place_units(write_thread_t *thread)
+{
+	write_job_t *job = thread->job;
+	size_t i;
+
+	for (i = job->first; i < job->end && !thread->error; i++) {
+		const write_unit_t *unit = job->units + i;
+		const vstr_t *mem = &job->threads[unit->thread].mem;
+
+		if (job->seekable && unit->thread != thread->index)
+			continue;
+
+		thread->error = write_at(job->fd, mem->data + unit->offs,
+		                         unit->len,
+		                         job->seekable ? unit->pos : -1);
+	}
+}
+
+// see write_parallel for the other side of the barriers
+static void *write_worker(void *arg)
+{
+	write_thread_t *thread = arg;
+	write_job_t *job = thread->job;
+
+	while (1) {
+		barrier_wait(&job->barrier); // the round is set up
+		if (job->done)
+			break;
+
+		format_units(thread);
+		barrier_wait(&job->barrier); // the units are formatted
+		barrier_wait(&job->barrier); // ... and have their offsets
+		if (job->done)
+			break;
+
+		if (job->seekable)
+			place_units(thread);
+
+		barrier_wait(&job->barrier); // ... and written
+	}
+
+	return NULL;
+}
+
+//RETURN VALUE
+//	0 on success, errno on failure
+static int write_parallel(const map_t *map, int fd, int flags, int jobs)
+{
+	int rv = ENOMEM;
+	write_job_t job;
+	struct stat st;
+	size_t i, num_started = 0, round_units;
+	off_t pos = 0;
+
+	memset(&job, 0, sizeof(job));
+	job.map = map;
+	job.flags = flags;
+	job.fd = fd;
+	job.seekable = !fstat(fd, &st) && S_ISREG(st.st_mode);
+
+	job.num_units = cut_units(map, NULL);
+	job.units = malloc(job.num_units * sizeof(write_unit_t));
+	job.threads = calloc(jobs, sizeof(write_thread_t));
+	if (!job.units || !job.threads)
 		goto out;
+
+	cut_units(map, job.units);
+
+	pthread_mutex_init(&job.barrier.mutex, NULL);
+	pthread_cond_init(&job.barrier.cond, NULL);
+	job.barrier.count = jobs;
+	job.num_threads = jobs;
+
+	for (i = 0; i < job.num_threads; i++) {
+		job.threads[i].job = &job;
+		job.threads[i].index = i;
+		vstr_init(&job.threads[i].mem);
+	}
+
+	// the main thread is threads[0]
+	for (num_started = 1; num_started < job.num_threads; num_started++)
+		if (pthread_create(&job.threads[num_started].thread, NULL,
+		                   write_worker, job.threads + num_started))
+			break;
+
+	// nobody can be through the first barrier without the main thread
+	job.num_threads = num_started;
+	barrier_set_count(&job.barrier, num_started);
+
+	round_units = job.num_threads * UNITS_PER_JOB;
+	for (job.first = 0; job.first < job.num_units; job.first = job.end) {
+		job.end = job.first + round_units;
+		if (job.end > job.num_units)
+			job.end = job.num_units;
+		job.next = job.first;
+
+		barrier_wait(&job.barrier); // the round is set up
+		format_units(job.threads);
+		barrier_wait(&job.barrier); // the units are formatted
+
+		for (i = 0; i < job.num_threads; i++)
+			if (job.threads[i].error)
+				job.done = true;
+
+		for (i = job.first; i < job.end; i++) {
+			job.units[i].pos = pos;
+			pos += job.units[i].len;
+		}
+
+		barrier_wait(&job.barrier); // ... and have their offsets
+		if (job.done)
+			break;
+
+		place_units(job.threads);
+		barrier_wait(&job.barrier); // ... and written
+	}
+
+	if (!job.done) {
+		job.done = true;
+		barrier_wait(&job.barrier);
 	}
 
-	fp = NULL;
 	rv = 0;
+	for (i = 0; i < job.num_threads; i++) {
+		if (i)
+			pthread_join(job.threads[i].thread, NULL);
+		if (!rv)
+			rv = job.threads[i].error;
+	}
+
+	pthread_mutex_destroy(&job.barrier.mutex);
+	pthread_cond_destroy(&job.barrier.cond);
 
 out:
-	if (fp)
-		fclose(fp);
+	if (job.threads)
+		for (i = 0; i < job.num_threads; i++)
+			vstr_free(&job.threads[i].mem);
+
+	free(job.units);
+	free(job.threads);
 	return rv;
 }
 
-int map_postprocess(map_t *map)
+//
+// postprocessing
+//
+
+// removes all mapcat_prefix keys from a worldspawn
+//RETURN VALUE
+//	the value of the last one, NULL if there was none
+static const char *take_prefix(entity_t *worldspawn)
+{
+	entity_key_t *key, *next;
+	const char *prefix = NULL;
+
+	for (key = worldspawn->keys; key; key = next) {
+		next = elist_next(key, list);
+
+		if (key->key == intern_mapcat_prefix) {
+			prefix = key->value;
+			elist_unlink(&worldspawn->keys, key, list);
+		}
+	}
+
+	return prefix;
+}
+
+// prepends prefix to the entity's target, targetname and team values
+// (except the global ones)
+// note: the values aren't concatenated, the prefix is written before them
+// (see write_key)
+static void prefix_entity(entity_t *entity, const char *prefix)
 {
-	entity_t *entity;
 	entity_key_t *key;
-	char *prefix = NULL;
 
-	if (map->worldspawn) {
-		entity_key_t *next;
+	elist_for(key, entity->keys, list) {
+		if (key->key != intern_target &&
+		    key->key != intern_targetname &&
+		    key->key != intern_team)
+			continue;
 
-		for (key = map->worldspawn->keys; key; key = next) {
-			next = elist_next(key, list);
+		if (!strncmp(key->value, "global_", 7))
+			continue;
 
-			if (!strcmp(key->key, "mapcat_prefix")) {
-				// shouldn't happen, but just in case
-				// (to prevent memory leaks)
-				if (prefix)
-					free(prefix);
+		key->prefix = prefix;
+		entity->modified = true;
+	}
+}
 
-				prefix = key->value;
-				elist_unlink(&map->worldspawn->keys, key, list);
-				free(key->key);
-				// key->value is freed later (as prefix)
-				free(key);
-			}
+//
+// streaming
+//
+
+// In the streaming mode the output is written while the inputs are being
+// read. The first worldspawn's keys go out as soon as they're known and
+// every worldspawn brush right after it's read. The other entities are
+// spooled to a temporary file, which is appended to the output at the end.
+// Only a single entity (and a single worldspawn brush) is kept in memory at
+// a time, except for entities that come before the worldspawn in their
+// file. These have to wait for its mapcat_prefix.
+
+// called with the worldspawn of the current input once its keys are read
+static int stream_worldspawn(map_stream_t *stream, entity_t *worldspawn)
+{
+	const char *prefix;
+
+	if (stream->worldspawn == worldspawn)
+		return 0;
+
+	stream->worldspawn = worldspawn;
+
+	prefix = take_prefix(worldspawn);
+	if (prefix) {
+		size_t len = strlen(prefix);
+		char *copy;
+
+		// the entity itself won't live as long as the input
+		copy = arena_alloc(&stream->input->arena, len + 1);
+		if (!copy) {
+			fprintf(stderr, "error: out of memory\n");
+			return 1;
 		}
+
+		memcpy(copy, prefix, len + 1);
+		stream->prefix = copy;
 	}
 
-	if (prefix) {
-		size_t prefix_len = strlen(prefix);
+	if (stream->has_worldspawn)
+		return 0;
 
-		elist_for(entity, map->entities, list)
-		elist_for(key, entity->keys, list) {
-			char *new;
-			size_t value_len;
+	if (!(stream->flags & MAPCAT_COMPACT))
+		output_puts(&stream->out, "// entity 0\n");
 
-			if (strcmp(key->key, "target") &&
-			    strcmp(key->key, "targetname") &&
-			    strcmp(key->key, "team"))
-				continue;
+	output_put(&stream->out, "{\n", 2);
+	write_entity(&stream->out, worldspawn, stream->flags);
+	stream->has_worldspawn = true;
+	return 0;
+}
 
-			if (!strncmp(key->value, "global_", 7))
-				continue;
+static void stream_brush(map_stream_t *stream, const entity_t *entity,
+                         const brush_t *brush)
+{
+	// note: entity is a worldspawn
+	stream_worldspawn(stream, (entity_t*)entity);
 
-			value_len = strlen(key->value);
+	if (!(stream->flags & MAPCAT_COMPACT))
+		put_counter(&stream->out, "// brush ", stream->num_brushes);
 
-			new = malloc(value_len + prefix_len + 1);
-			if (!new) {
-				fprintf(stderr, "error: out of memory\n");
-				return 1;
-			}
+	write_brush_braced(&stream->out, brush, stream->flags);
+	stream->num_brushes++;
+}
+
+// spools the entities read so far
+static void stream_flush(map_stream_t *stream)
+{
+	entity_t *entity;
+
+	elist_for(entity, stream->entity.entities, list) {
+		if (stream->prefix)
+			prefix_entity(entity, stream->prefix);
+
+		if (!(stream->flags & MAPCAT_COMPACT))
+			put_counter(&stream->spool, "// entity ",
+			            ++stream->num_entities);
+
+		write_entity_braced(&stream->spool, entity, stream->flags);
+	}
+
+	map_clear(&stream->entity);
+}
+
+// map_merge and map_print_stats only need to know the worldspawn is there
+static int add_worldspawn_stub(map_t *map)
+{
+	map->worldspawn = arena_alloc(&map->arena, sizeof(entity_t));
+	if (!map->worldspawn)
+		return 1;
+
+	memset(map->worldspawn, 0, sizeof(entity_t));
+	map->worldspawn->classname = intern_worldspawn;
+	return 0;
+}
+
+static int stream_entity(lexer_state_t *ls, map_stream_t *stream)
+{
+	map_t *map = stream->input, *tmp = &stream->entity;
+
+	if (read_entity(ls, tmp))
+		return 1;
+
+	map_add_counters(map, tmp);
+	tmp->num_entities = tmp->num_discarded_entities = 0;
+	tmp->num_brushes = tmp->num_discarded_brushes = 0;
+	tmp->num_patches = tmp->num_discarded_patches = 0;
+
+	if (tmp->worldspawn) {
+		if (map->worldspawn) {
+			lexer_perror(ls, "this entity is a worldspawn, but a "
+			                 "worldspawn was already read earlier");
+			return 1;
+		}
+
+		if (stream_worldspawn(stream, tmp->worldspawn))
+			return 1;
+
+		if (add_worldspawn_stub(map)) {
+			lexer_perror(ls, "out of memory\n");
+			return 1;
+		}
+
+		tmp->worldspawn = NULL;
+		stream->worldspawn = NULL;
+	}
+
+	// wait for this input's mapcat_prefix
+	if (map->worldspawn)
+		stream_flush(stream);
+
+	return 0;
+}
+
+// binary maps are mapped in whole anyway, so they're streamed after
+// they're read
+static int stream_binary(map_stream_t *stream, map_t *binary)
+{
+	map_t *map = stream->input;
+	brush_t *brushes, *brush;
+
+	map_add_counters(map, binary);
+
+	if (binary->worldspawn) {
+		// the keys go out first, on their own
+		brushes = binary->worldspawn->brushes;
+		binary->worldspawn->brushes = NULL;
+
+		if (stream_worldspawn(stream, binary->worldspawn))
+			return 1;
+
+		elist_for(brush, brushes, list)
+			stream_brush(stream, binary->worldspawn, brush);
+
+		if (add_worldspawn_stub(map)) {
+			fprintf(stderr, "error: out of memory\n");
+			return 1;
+		}
+	}
+
+	stream->entity.entities = binary->entities;
+	stream_flush(stream);
+	return 0;
+}
+
+//
+// sources
+//
+
+// Brushes and entities point into their mapped inputs (see copy_verbatim),
+// so the mappings are handed over from the lexer to the map and live as
+// long as it does.
+
+static int keep_source(map_t *map, lexer_state_t *ls)
+{
+	map_source_t *source;
+
+	if (!ls->map)
+		return 0;
+
+	source = arena_alloc(&map->arena, sizeof(map_source_t));
+	if (!source) {
+		fprintf(stderr, "error: out of memory\n");
+		return 1;
+	}
+
+	memset(source, 0, sizeof(*source));
+	source->data = ls->map;
+	source->size = ls->map_size;
+	source->dev = ls->map_dev;
+	source->ino = ls->map_ino;
+	elist_append(&map->sources, source, list);
+
+	ls->map = NULL;
+	return 0;
+}
+
+// Truncating a mapped file would pull the memory from under the brushes,
+// so an input that's about to be overwritten by the output gets its pages
+// replaced with anonymous ones (at the same address) first.
+static int detach_sources(const map_t *map, const char *path)
+{
+	struct stat st;
+	const map_source_t *source;
+
+	if (stat(path, &st))
+		return 0;
+
+	elist_cfor(source, map->sources, list) {
+		char *copy;
+		void *ret;
+
+		if (source->dev != st.st_dev || source->ino != st.st_ino)
+			continue;
+
+		copy = malloc(source->size);
+		if (!copy) {
+			fprintf(stderr, "error: out of memory\n");
+			return 1;
+		}
+
+		memcpy(copy, source->data, source->size);
+		ret = mmap(source->data, source->size, PROT_READ | PROT_WRITE,
+		           MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+		if (ret == MAP_FAILED) {
+			perror("mmap");
+			free(copy);
+			return 1;
+		}
+
+		memcpy(source->data, copy, source->size);
+		free(copy);
+	}
+
+	return 0;
+}
+
+//
+// entry points
+//
+
+void map_init(map_t *map)
+{
+	memset(map, 0, sizeof(*map));
+	arena_init(&map->arena);
+}
+
+void map_free(map_t *map)
+{
+	map_source_t *source;
+
+	elist_for(source, map->sources, list)
+		munmap(source->data, source->size);
+
+	arena_free(&map->arena);
+	map_init(map);
+}
+
+// note: big files are split and read by up to jobs threads
+int map_read(map_t *map, const char *path, int jobs)
+{
+	int rv = 1;
+	lexer_state_t lexer;
+	vstr_t token;
+	double start;
+
+	rv = map_read_binary(map, path);
+	if (rv >= 0)
+		return rv;
+
+	rv = 1;
+	vstr_init(&token);
+
+	start = trace_begin();
+	if (lexer_open(&lexer, path, &token)) {
+		perror(path);
+		return 1;
+	}
+	trace_end(start, "lexer_open", path, lexer.map_size);
+
+	if (lexer.map && lexer.map_size >= 2 * CHUNK_MIN_SIZE && jobs > 1 &&
+	    !read_parallel(map, path, lexer.map, lexer.map_size, jobs)) {
+		rv = 0;
+		goto out;
+	}
+
+	while (1) {
+		int ret;
+
+		ret = lexer_expect_or_eof(&lexer, TOKEN_LBRACE,
+		                          "the beginning of an entity");
+		if (ret == -1)
+			break;
+		if (ret > 0)
+			goto out;
+
+		if (read_entity(&lexer, map))
+			goto out;
+	}
+
+	rv = 0;
+out:
+	if (!rv)
+		rv = keep_source(map, &lexer);
+
+	map->num_tokens += lexer.num_tokens;
+	map->num_floats += lexer.num_floats;
+
+	vstr_free(&token);
+	lexer_close(&lexer);
+
+	if (rv)
+		map_free(map);
+
+	return rv;
+}
+
+// note: big maps are formatted by up to jobs threads
+int map_write(const map_t *map, const char *path, int flags, int jobs)
+{
+	int rv = 1, fd = -1, ret, format;
+	output_t out;
+
+	if (!map->worldspawn) {
+		fprintf(stderr, "error: worldspawn is missing\n");
+		goto out;
+	}
+
+	if (detach_sources(map, path))
+		goto out;
+
+	if (flags & MAPCAT_BINARY)
+		return map_write_binary(map, path, flags);
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0) {
+		perror(path);
+		goto out;
+	}
+
+	// compressed data has to be written in order (but zstd has threads
+	// of its own)
+	format = compress_format_of(path);
 
-			memcpy(new, prefix, prefix_len);
-			memcpy(new + prefix_len, key->value, value_len);
-			new[prefix_len + value_len] = 0;
+	if (!format && jobs > 1 && cut_units(map, NULL) >= WRITE_MIN_UNITS) {
+		ret = -write_parallel(map, fd, flags, jobs);
+	} else {
+		output_init(&out, fd);
 
-			free(key->value);
-			key->value = new;
+		if (format) {
+			out.comp = compress_open(fd, path, format, jobs);
+			if (!out.comp) {
+				perror(path);
+				goto out;
+			}
 		}
 
-		free(prefix);
+		if (!(flags & MAPCAT_COMPACT))
+			output_puts(&out, "// entity 0\n");
+
+		output_put(&out, "{\n", 2);
+		write_entity(&out, map->worldspawn, flags);
+		output_put(&out, "}\n", 2);
+
+		write_entities(&out, map->entities, SIZE_MAX, 1, flags);
+		ret = output_finish(&out);
+	}
+
+	if (ret) {
+		errno = -ret;
+		perror(path);
+		goto out;
+	}
+
+	ret = close(fd);
+	fd = -1;
+	if (ret) {
+		perror(path);
+		goto out;
 	}
 
+	rv = 0;
+
+out:
+	if (fd >= 0)
+		close(fd);
+	return rv;
+}
+
+int map_postprocess(map_t *map)
+{
+	entity_t *entity;
+	const char *prefix = NULL;
+
+	if (map->worldspawn)
+		prefix = take_prefix(map->worldspawn);
+
+	if (prefix)
+		elist_for(entity, map->entities, list)
+			prefix_entity(entity, prefix);
+
 	return 0;
 }
 
@@ -714,25 +1912,32 @@ int map_merge(map_t *master, map_t *slave)
 		// brushes, which are appended to the master's worldspawn
 		elist_append_list(&master->worldspawn->brushes,
 		                  slave->worldspawn->brushes, list);
-
-		free_entity_keys(slave->worldspawn);
-		free(slave->worldspawn->classname);
-		free(slave->worldspawn);
 	}
 
 	// entities are always kept intact
 	elist_append_list(&master->entities, slave->entities, list);
+	elist_append_list(&master->sources, slave->sources, list);
 
-	master->num_entities += slave->num_entities;
-	master->num_discarded_entities += slave->num_discarded_entities;
-	master->num_brushes += slave->num_brushes;
-	master->num_discarded_brushes += slave->num_discarded_brushes;
-	master->num_patches += slave->num_patches;
-	master->num_discarded_patches += slave->num_discarded_patches;
+	// everything above lives in the slave's arena
+	arena_adopt(&master->arena, &slave->arena);
+	map_add_counters(master, slave);
 
 	return 0;
 }
 
+// the numbers of discarded and duplicate ones, if any
+static void print_dropped(size_t discarded, size_t duplicates)
+{
+	if (discarded && duplicates)
+		printf(" (%zu discarded, %zu duplicate%s)", discarded,
+		       duplicates, (duplicates == 1 ? "" : "s"));
+	else if (discarded)
+		printf(" (%zu discarded)", discarded);
+	else if (duplicates)
+		printf(" (%zu duplicate%s)", duplicates,
+		       (duplicates == 1 ? "" : "s"));
+}
+
 void map_print_stats(const char *path, const map_t *map)
 {
 	size_t ents_with_worldspawn;
@@ -743,18 +1948,218 @@ void map_print_stats(const char *path, const map_t *map)
 
 	printf("%zu entit%s", ents_with_worldspawn,
 	       (ents_with_worldspawn == 1 ? "y" : "ies"));
-	if (map->num_discarded_entities)
-		printf(" (%zu discarded)", map->num_discarded_entities);
+	print_dropped(map->num_discarded_entities,
+	              map->num_duplicate_entities);
 
 	printf(", %zu brush%s", map->num_brushes,
 	       (map->num_brushes == 1 ? "" : "es"));
-	if (map->num_discarded_brushes)
-		printf(" (%zu discarded)", map->num_discarded_brushes);
+	print_dropped(map->num_discarded_brushes, map->num_duplicate_brushes);
 
 	printf(", %zu patch%s", map->num_patches,
 	       (map->num_patches == 1 ? "" : "es"));
-	if (map->num_discarded_patches)
-		printf(" (%zu discarded)", map->num_discarded_patches);
+	print_dropped(map->num_discarded_patches, map->num_duplicate_patches);
 
 	printf("\n");
 }
+
+static void stream_cleanup(map_stream_t *stream)
+{
+	if (stream->out.fd >= 0)
+		close(stream->out.fd);
+
+	if (stream->spool.fd >= 0)
+		close(stream->spool.fd);
+
+	stream->out.fd = stream->spool.fd = -1;
+	compress_free(stream->out.comp);
+	stream->out.comp = NULL;
+	map_free(&stream->entity);
+	map_free(&stream->brush);
+}
+
+int map_stream_open(map_stream_t *stream, const char *path, int flags)
+{
+	FILE *spool;
+	int format;
+
+	memset(stream, 0, sizeof(*stream));
+	stream->path = path;
+	stream->flags = flags;
+	map_init(&stream->entity);
+	map_init(&stream->brush);
+	stream->entity.stream = stream;
+
+	// the scratch maps are cleared right after every brush and entity
+	output_init(&stream->out, -1);
+	output_init(&stream->spool, -1);
+	stream->out.copy = stream->spool.copy = true;
+
+	stream->out.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (stream->out.fd < 0) {
+		perror(path);
+		stream_cleanup(stream);
+		return 1;
+	}
+
+	format = compress_format_of(path);
+	if (format) {
+		stream->out.comp = compress_open(stream->out.fd, path, format,
+		                                 1);
+		if (!stream->out.comp) {
+			perror(path);
+			stream_cleanup(stream);
+			return 1;
+		}
+	}
+
+	// the duplicate descriptor keeps the (already deleted) file around
+	spool = tmpfile();
+	if (spool) {
+		stream->spool.fd = dup(fileno(spool));
+		fclose(spool);
+	}
+
+	if (stream->spool.fd < 0) {
+		perror("tmpfile");
+		map_stream_abort(stream);
+		return 1;
+	}
+
+	return 0;
+}
+
+// like map_read followed by map_postprocess, except that everything goes to
+// the stream instead of map, which is only left with the counters
+int map_stream_read(map_stream_t *stream, map_t *map, const char *path)
+{
+	int rv = 1;
+	lexer_state_t lexer;
+	vstr_t token;
+	map_t binary;
+	double start;
+
+	stream->input = map;
+	stream->worldspawn = NULL;
+	stream->prefix = NULL;
+
+	map_init(&binary);
+	rv = map_read_binary(&binary, path);
+	if (rv >= 0) {
+		if (!rv)
+			rv = stream_binary(stream, &binary);
+
+		map_free(&binary);
+		goto out_binary;
+	}
+
+	rv = 1;
+	vstr_init(&token);
+
+	start = trace_begin();
+	if (lexer_open(&lexer, path, &token)) {
+		perror(path);
+		stream->input = NULL;
+		return 1;
+	}
+	trace_end(start, "lexer_open", path, lexer.map_size);
+
+	while (1) {
+		int ret;
+
+		ret = lexer_expect_or_eof(&lexer, TOKEN_LBRACE,
+		                          "the beginning of an entity");
+		if (ret == -1)
+			break;
+		if (ret > 0)
+			goto out;
+
+		if (stream_entity(&lexer, stream))
+			goto out;
+	}
+
+	stream_flush(stream);
+	rv = 0;
+out:
+	map->num_tokens += lexer.num_tokens;
+	map->num_floats += lexer.num_floats;
+
+	vstr_free(&token);
+	lexer_close(&lexer);
+
+out_binary:
+	map_clear(&stream->entity);
+	map_clear(&stream->brush);
+	stream->input = NULL;
+
+	if (rv)
+		map_free(map);
+
+	return rv;
+}
+
+// finishes the output, the stream is closed even if this fails
+int map_stream_close(map_stream_t *stream)
+{
+	int ret;
+	ssize_t size;
+
+	if (!stream->has_worldspawn) {
+		fprintf(stderr, "error: worldspawn is missing\n");
+		goto fail;
+	}
+
+	output_put(&stream->out, "}\n", 2);
+
+	ret = output_flush(&stream->spool);
+	if (ret || lseek(stream->spool.fd, 0, SEEK_SET)) {
+		errno = ret ? -ret : errno;
+		perror("tmpfile");
+		goto fail;
+	}
+
+	// the spool is read straight into the output's buffer
+	while (1) {
+		char *buf = output_reserve(&stream->out, OUTPUT_BUFFER);
+
+		size = read(stream->spool.fd, buf, OUTPUT_BUFFER);
+		if (size < 0 && errno == EINTR)
+			continue;
+		if (size <= 0)
+			break;
+
+		output_commit(&stream->out, size);
+	}
+
+	if (size < 0) {
+		perror("tmpfile");
+		goto fail;
+	}
+
+	ret = output_finish(&stream->out);
+	if (ret) {
+		errno = -ret;
+		perror(stream->path);
+		goto fail;
+	}
+
+	ret = close(stream->out.fd);
+	stream->out.fd = -1;
+	if (ret) {
+		perror(stream->path);
+		goto fail;
+	}
+
+	stream_cleanup(stream);
+	return 0;
+
+fail:
+	map_stream_abort(stream);
+	return 1;
+}
+
+// closes the stream and removes the (incomplete) output
+void map_stream_abort(map_stream_t *stream)
+{
+	stream_cleanup(stream);
+	unlink(stream->path);
+}
@@ -0,0 +1,307 @@
+/*
+Copyright (C) 2016  Paweł Redman
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 3
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software Foundation,
+Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+*/
+
+#include "common.h"
+#include <stdint.h>
+#include <float.h>
+#include <math.h>
+
+// every power of ten up to 1e22 is exactly representable as a double
+static const double pow10_exact[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+//RETURN VALUES
+//	0 on success
+//	1 if the value can't be converted exactly by the fast path
+// note: w * 10^e10 is computed with a single rounding to double, which is
+// then rounded to float. The double rounding can only go wrong if the
+// double lands exactly in the middle between two floats, so such values
+// (and anything outside the range of normal floats) are rejected.
+static int decimal_to_float(bool neg, uint64_t w, int e10, float *out)
+{
+	double d;
+	uint64_t bits;
+
+	if (!w) {
+		*out = neg ? -0.0f : 0.0f;
+		return 0;
+	}
+
+	if (w > (1ull << 53) || e10 < -22 || e10 > 22)
+		return 1;
+
+	d = w;
+	if (e10 < 0)
+		d /= pow10_exact[-e10];
+	else
+		d *= pow10_exact[e10];
+
+	if (d < FLT_MIN || d > FLT_MAX)
+		return 1;
+
+	// the 29 bits that don't fit in a float's mantissa
+	memcpy(&bits, &d, sizeof(bits));
+	if ((bits & ((1ull << 29) - 1)) == (1ull << 28))
+		return 1;
+
+	*out = neg ? -(float)d : (float)d;
+	return 0;
+}
+
+//RETURN VALUES
+//	0 on success
+//	1 if str isn't a plain decimal number or it can't be converted exactly
+// note: accepts [+-]digits[.digits][(e|E)[+-]digits], the whole string has
+// to match. The result is the same as strtof's in the C locale.
+int parse_float(const char *str, size_t len, float *out)
+{
+	const char *p = str, *e = str + len;
+	bool neg = false, exp_neg = false;
+	uint64_t w = 0;
+	int digits = 0, e10 = 0, exp = 0;
+	bool any = false;
+
+	if (p < e && (*p == '-' || *p == '+')) {
+		neg = (*p == '-');
+		p++;
+	}
+
+	for (; p < e && *p >= '0' && *p <= '9'; p++) {
+		any = true;
+		if (!w && *p == '0')
+			continue;
+
+		if (++digits > 19)
+			return 1;
+
+		w = w * 10 + (*p - '0');
+	}
+
+	if (p < e && *p == '.') {
+		for (p++; p < e && *p >= '0' && *p <= '9'; p++) {
+			any = true;
+			e10--;
+			if (!w && *p == '0')
+				continue;
+
+			if (++digits > 19)
+				return 1;
+
+			w = w * 10 + (*p - '0');
+		}
+	}
+
+	if (!any)
+		return 1;
+
+	if (p < e && (*p == 'e' || *p == 'E')) {
+		p++;
+		if (p < e && (*p == '-' || *p == '+')) {
+			exp_neg = (*p == '-');
+			p++;
+		}
+
+		if (p == e)
+			return 1;
+
+		for (; p < e && *p >= '0' && *p <= '9'; p++) {
+			if (exp > 1000)
+				return 1;
+
+			exp = exp * 10 + (*p - '0');
+		}
+
+		e10 += exp_neg ? -exp : exp;
+	}
+
+	if (p != e)
+		return 1;
+
+	return decimal_to_float(neg, w, e10, out);
+}
+
+// like strtof, but str doesn't have to be NUL-terminated
+float str_to_float(const char *str, size_t len)
+{
+	char tmp[64], *buf = tmp;
+	float rv;
+
+	if (!parse_float(str, len, &rv))
+		return rv;
+
+	if (len >= sizeof(tmp)) {
+		buf = malloc(len + 1);
+		if (!buf)
+			return 0;
+	}
+
+	memcpy(buf, str, len);
+	buf[len] = 0;
+	rv = strtof(buf, NULL);
+
+	if (buf != tmp)
+		free(buf);
+
+	return rv;
+}
+
+// like strtoull, but str doesn't have to be NUL-terminated
+size_t str_to_size(const char *str, size_t len)
+{
+	char tmp[64];
+
+	if (len >= sizeof(tmp))
+		len = sizeof(tmp) - 1; // no size_t needs that many digits
+
+	memcpy(tmp, str, len);
+	tmp[len] = 0;
+	return strtoull(tmp, NULL, 10);
+}
+
+static const uint64_t pow10_int[] = {
+	1ull, 10ull, 100ull, 1000ull, 10000ull, 100000ull, 1000000ull,
+	10000000ull, 100000000ull, 1000000000ull, 10000000000ull,
+	100000000000ull, 1000000000000ull
+};
+
+// rounds a non-negative double to an integer, ties to even (like printf)
+static inline uint64_t round_even(double a)
+{
+	uint64_t r = a;
+	double frac = a - r;
+
+	if (frac > 0.5 || (frac == 0.5 && (r & 1)))
+		r++;
+
+	return r;
+}
+
+// writes r / 10^decimals with exactly that many decimals
+static size_t put_decimal(char *buf, bool neg, uint64_t r, int decimals)
+{
+	char tmp[24], *p = buf;
+	uint64_t ip = r / pow10_int[decimals], fp = r % pow10_int[decimals];
+	int i, n = 0;
+
+	if (neg)
+		*(p++) = '-';
+
+	do {
+		tmp[n++] = '0' + ip % 10;
+		ip /= 10;
+	} while (ip);
+
+	while (n)
+		*(p++) = tmp[--n];
+
+	if (decimals) {
+		*(p++) = '.';
+		for (i = decimals - 1; i >= 0; i--) {
+			p[i] = '0' + fp % 10;
+			fp /= 10;
+		}
+		p += decimals;
+	}
+
+	*p = 0;
+	return p - buf;
+}
+
+//RETURN VALUE
+//	the length of the string written to buf
+// note: the output is the same as printf's "%.*f" (decimals <= 12), buf
+// has to be at least FLOAT_BUFFER bytes long
+size_t format_float_fixed(char *buf, float x, int decimals)
+{
+	double a;
+
+	// |x| * 10^decimals is exact in a double as long as 5^decimals fits
+	// in the 29 bits a double has over a float
+	a = fabsf(x) * (double)pow10_int[decimals];
+	if (decimals > 12 || !(a < 9.2e18))
+		return snprintf(buf, FLOAT_BUFFER, "%.*f", decimals, x);
+
+	return put_decimal(buf, signbit(x), round_even(a), decimals);
+}
+
+//RETURN VALUE
+//	the length of the string written to buf
+// note: writes the shortest fixed-point string that reads back (with
+// strtof) as exactly the same float, buf has to be at least FLOAT_BUFFER
+// bytes long
+size_t format_float_short(char *buf, float x)
+{
+	bool neg = signbit(x);
+	float ax = fabsf(x), lo, hi;
+	uint32_t bits, nbits;
+	bool even;
+	double a = ax, mid_lo, mid_hi;
+	int k;
+
+	if (!isfinite(x))
+		return snprintf(buf, FLOAT_BUFFER, "%f", x);
+
+	// integers (every float above 2^23 is one)
+	if (a < 9.2e18 && a == (uint64_t)a)
+		return put_decimal(buf, neg, a, 0);
+
+	// everything strictly between the midpoints to the neighbouring floats
+	// reads back as x, the midpoints themselves only if x is even. Both
+	// the midpoints and their products with 10^k (k <= 12) are exact.
+	memcpy(&bits, &ax, sizeof(bits));
+	even = !(bits & 1);
+	nbits = bits - 1;
+	memcpy(&lo, &nbits, sizeof(lo));
+	nbits = bits + 1;
+	memcpy(&hi, &nbits, sizeof(hi));
+	mid_lo = (a + lo) / 2;
+	mid_hi = (a + hi) / 2;
+
+	for (k = 1; k <= 12; k++) {
+		double p10 = pow10_int[k], s = a * p10, r;
+
+		if (!(s < 9007199254740992.0)) // 2^53
+			break;
+
+		r = round_even(s);
+		if ((r > mid_lo * p10 && r < mid_hi * p10) ||
+		    (even && (r == mid_lo * p10 || r == mid_hi * p10)))
+			return put_decimal(buf, neg, r, k);
+	}
+
+	// very small numbers
+	for (k = 1; k < 9; k++) {
+		size_t len;
+
+		len = snprintf(buf, FLOAT_BUFFER, "%.*g", k, x);
+		if (strtof(buf, NULL) == x)
+			return len;
+	}
+
+	return snprintf(buf, FLOAT_BUFFER, "%.9g", x);
+}
+
+//RETURN VALUE
+//	the length of the string written to buf
+// note: buf has to be at least FLOAT_BUFFER bytes long
+size_t format_size(char *buf, size_t x)
+{
+	return put_decimal(buf, false, x, 0);
+}
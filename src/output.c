@@ -0,0 +1,184 @@
+/*
+Copyright (C) 2016  Paweł Redman
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 3
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software Foundation,
+Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+*/
+
+// The output is gathered into a batch of iovecs that's written with a
+// single writev. Short pieces (and everything formatted in place with
+// output_reserve) are copied into the batch's buffer, long ones are
+// referenced where they are, so they have to stay put until the batch is
+// flushed. Errors are only remembered and reported by output_flush.
+//
+// An output can also be gathered in memory instead (see output_init_mem),
+// which is how the text is formatted in parallel (see map_write), or go
+// through a compressor (see compress.c).
+
+#include "common.h"
+#include <unistd.h>
+
+// pieces shorter than this are cheaper to copy than to give an iovec
+#define OUTPUT_COPY_MAX 64
+
+void output_init(output_t *out, int fd)
+{
+	out->fd = fd;
+	out->mem = NULL;
+	out->comp = NULL;
+	out->error = 0;
+	out->copy = false;
+	out->num_iov = 0;
+	out->buf_used = 0;
+}
+
+// every flush appends to mem, which is never cleared by the output
+void output_init_mem(output_t *out, vstr_t *mem)
+{
+	output_init(out, -1);
+	out->mem = mem;
+}
+
+// writes the batch out, even if it's only partially written at a time
+static void write_batch(output_t *out)
+{
+	struct iovec *iov = out->iov;
+	size_t num_iov = out->num_iov;
+
+	for (; out->mem && num_iov && !out->error; iov++, num_iov--)
+		if (vstr_putn(out->mem, iov->iov_base, iov->iov_len))
+			out->error = ENOMEM;
+
+	for (; out->comp && num_iov && !out->error; iov++, num_iov--)
+		out->error = compress_write(out->comp, iov->iov_base,
+		                            iov->iov_len);
+
+	while (num_iov && !out->error) {
+		ssize_t ret;
+
+		ret = writev(out->fd, iov, num_iov);
+		if (ret < 0) {
+			if (errno != EINTR)
+				out->error = errno;
+			continue;
+		}
+
+		while (num_iov && (size_t)ret >= iov->iov_len) {
+			ret -= iov->iov_len;
+			iov++;
+			num_iov--;
+		}
+
+		if (num_iov) {
+			iov->iov_base = (char*)iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+	}
+
+	out->num_iov = 0;
+	out->buf_used = 0;
+}
+
+//RETURN VALUE
+//	0 on success, -errno of the first error that happened since
+//	output_init
+int output_flush(output_t *out)
+{
+	write_batch(out);
+	return -out->error;
+}
+
+// like output_flush, but also ends the compressed data (if any), nothing
+// can be written after this
+int output_finish(output_t *out)
+{
+	int ret;
+
+	write_batch(out);
+
+	if (out->comp) {
+		ret = compress_finish(out->comp);
+		if (!out->error)
+			out->error = ret;
+
+		out->comp = NULL;
+	}
+
+	return -out->error;
+}
+
+//RETURN VALUE
+//	room for size bytes (at most OUTPUT_BUFFER) in the batch's buffer, see
+//	output_commit
+char *output_reserve(output_t *out, size_t size)
+{
+	if (OUTPUT_BUFFER - out->buf_used < size ||
+	    out->num_iov == OUTPUT_IOVECS)
+		write_batch(out);
+
+	return out->buf + out->buf_used;
+}
+
+// adds size bytes written at output_reserve's pointer to the batch
+void output_commit(output_t *out, size_t size)
+{
+	char *p = out->buf + out->buf_used;
+	struct iovec *last = out->num_iov ? out->iov + out->num_iov - 1 : NULL;
+
+	if (!size)
+		return;
+
+	// consecutive copies go out as one piece
+	if (last && (char*)last->iov_base + last->iov_len == p)
+		last->iov_len += size;
+	else {
+		out->iov[out->num_iov].iov_base = p;
+		out->iov[out->num_iov].iov_len = size;
+		out->num_iov++;
+	}
+
+	out->buf_used += size;
+}
+
+void output_put(output_t *out, const void *data, size_t size)
+{
+	if (out->error)
+		return;
+
+	if (size < OUTPUT_COPY_MAX || out->copy) {
+		while (size) {
+			size_t piece = size < OUTPUT_BUFFER ?
+			               size : OUTPUT_BUFFER;
+
+			memcpy(output_reserve(out, piece), data, piece);
+			output_commit(out, piece);
+			data = (const char*)data + piece;
+			size -= piece;
+		}
+
+		return;
+	}
+
+	if (out->num_iov == OUTPUT_IOVECS)
+		write_batch(out);
+
+	out->iov[out->num_iov].iov_base = (void*)data;
+	out->iov[out->num_iov].iov_len = size;
+	out->num_iov++;
+}
+
+void output_puts(output_t *out, const char *str)
+{
+	output_put(out, str, strlen(str));
+}
@@ -0,0 +1,195 @@
+/*
+Copyright (C) 2016  Paweł Redman
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 3
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software Foundation,
+Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+*/
+
+// --profile keeps a profile_t for every input and one for the total.
+// A phase's CPU time is that of the thread that ran it, so the helper
+// threads of a split input (see read_parallel) and of map_write aren't in
+// it. They are in the total's process_cpu.
+
+#include "common.h"
+#include <time.h>
+#include <sys/resource.h>
+
+static const char *phase_names[PROFILE_PHASES] = {
+	"read",
+	"postprocess",
+	"merge",
+	"write"
+};
+
+// the phases' spans in --trace
+static const char *phase_spans[PROFILE_PHASES] = {
+	"map_read",
+	"map_postprocess",
+	"map_merge",
+	"map_write"
+};
+
+static double clock_seconds(clockid_t id)
+{
+	struct timespec ts;
+
+	if (clock_gettime(id, &ts))
+		return 0;
+
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+void profile_start(profile_clock_t *clock)
+{
+	clock->wall = clock_seconds(CLOCK_MONOTONIC);
+	clock->cpu = clock_seconds(CLOCK_THREAD_CPUTIME_ID);
+	clock->trace = trace_begin();
+}
+
+// adds the time since profile_start to the phase (and traces it, path is
+// the span's argument)
+void profile_stop(profile_clock_t *clock, profile_t *profile, int phase,
+                  const char *path)
+{
+	struct rusage usage;
+
+	trace_end(clock->trace, phase_spans[phase], path, 0);
+
+	profile->wall[phase] += clock_seconds(CLOCK_MONOTONIC) - clock->wall;
+	profile->cpu[phase] += clock_seconds(CLOCK_THREAD_CPUTIME_ID) -
+	                       clock->cpu;
+
+	if (!getrusage(RUSAGE_SELF, &usage))
+		profile->peak_rss = usage.ru_maxrss;
+}
+
+// note: the arena's counters include everything that was merged into it
+void profile_add_map(profile_t *profile, const map_t *map)
+{
+	profile->tokens += map->num_tokens;
+	profile->floats += map->num_floats;
+	profile->allocs += map->arena.num_allocs;
+	profile->alloc_bytes += map->arena.used;
+}
+
+void profile_add(profile_t *total, const profile_t *profile)
+{
+	int i;
+
+	for (i = 0; i < PROFILE_PHASES; i++) {
+		total->wall[i] += profile->wall[i];
+		total->cpu[i] += profile->cpu[i];
+	}
+
+	total->bytes_read += profile->bytes_read;
+	total->bytes_written += profile->bytes_written;
+	total->tokens += profile->tokens;
+	total->floats += profile->floats;
+	total->allocs += profile->allocs;
+	total->alloc_bytes += profile->alloc_bytes;
+
+	if (total->peak_rss < profile->peak_rss)
+		total->peak_rss = profile->peak_rss;
+}
+
+// fills in what's known only at the end of the run
+void profile_finish(profile_t *profile)
+{
+	struct rusage usage;
+
+	if (getrusage(RUSAGE_SELF, &usage))
+		return;
+
+	profile->peak_rss = usage.ru_maxrss;
+	profile->process_cpu = usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+	                       (usage.ru_utime.tv_usec +
+	                        usage.ru_stime.tv_usec) * 1e-6;
+}
+
+void profile_print(const char *name, const profile_t *profile)
+{
+	int i;
+
+	printf("%s:\n", name);
+
+	for (i = 0; i < PROFILE_PHASES; i++) {
+		if (!profile->wall[i])
+			continue;
+
+		printf("  %-12s %10.3f ms wall %10.3f ms cpu\n", phase_names[i],
+		       profile->wall[i] * 1e3, profile->cpu[i] * 1e3);
+	}
+
+	if (profile->process_cpu)
+		printf("  %-12s %10.3f ms cpu (all threads)\n", "process",
+		       profile->process_cpu * 1e3);
+
+	printf("  %llu bytes read", (unsigned long long)profile->bytes_read);
+	if (profile->bytes_written)
+		printf(", %llu bytes written",
+		       (unsigned long long)profile->bytes_written);
+	printf("\n");
+	printf("  %llu tokens, %llu floats\n",
+	       (unsigned long long)profile->tokens,
+	       (unsigned long long)profile->floats);
+	printf("  %llu allocations, %llu bytes\n",
+	       (unsigned long long)profile->allocs,
+	       (unsigned long long)profile->alloc_bytes);
+	printf("  peak RSS %ld KB\n", profile->peak_rss);
+}
+
+// writes str as a quoted JSON string
+void json_print_string(FILE *fp, const char *str)
+{
+	putc('"', fp);
+
+	for (; *str; str++) {
+		unsigned char ch = *str;
+
+		if (ch == '"' || ch == '\\')
+			fprintf(fp, "\\%c", ch);
+		else if (ch < 0x20)
+			fprintf(fp, "\\u%04x", ch);
+		else
+			putc(ch, fp);
+	}
+
+	putc('"', fp);
+}
+
+// prints a single object, without a trailing newline
+void profile_print_json(const char *name, const profile_t *profile)
+{
+	int i;
+
+	printf("{\"name\": ");
+	json_print_string(stdout, name);
+
+	for (i = 0; i < PROFILE_PHASES; i++)
+		printf(", \"%s\": {\"wall\": %.6f, \"cpu\": %.6f}",
+		       phase_names[i], profile->wall[i], profile->cpu[i]);
+
+	if (profile->process_cpu)
+		printf(", \"process_cpu\": %.6f", profile->process_cpu);
+
+	printf(", \"bytes_read\": %llu, \"bytes_written\": %llu, "
+	       "\"tokens\": %llu, \"floats\": %llu, \"allocs\": %llu, "
+	       "\"alloc_bytes\": %llu, \"peak_rss_kb\": %ld}",
+	       (unsigned long long)profile->bytes_read,
+	       (unsigned long long)profile->bytes_written,
+	       (unsigned long long)profile->tokens,
+	       (unsigned long long)profile->floats,
+	       (unsigned long long)profile->allocs,
+	       (unsigned long long)profile->alloc_bytes, profile->peak_rss);
+}
@@ -0,0 +1,556 @@
+/*
+Copyright (C) 2016  Paweł Redman
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 3
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software Foundation,
+Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+*/
+
+// --region keeps only the worldspawn brushes and the entities whose
+// bounding boxes touch a box, so that just the part of a map that's being
+// worked on can be compiled.
+//
+// A brush's box is that of its corners, which are the intersections of
+// every three of its planes that lie inside the rest. A patch's box is
+// that of its control points, an entity's is that of its brushes or, if
+// it has none, its origin. Entities that have neither are kept.
+//
+// The boxes go into a bounding volume hierarchy (median splits along the
+// longest axis), which is then queried with the region.
+
+#include "common.h"
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define PLANE_EPSILON 0.01 // how far outside a plane a corner can be
+#define BRUSH_MAX_LOCAL_PLANES 64 // more than that are malloc'd
+#define BVH_LEAF_SIZE 4
+
+typedef struct {
+	float mins[3], maxs[3];
+} bounds_t;
+
+typedef struct {
+	bounds_t bounds;
+	size_t first, count; // of the items, count is 0 for inner nodes
+	size_t right; // the left child is the next node
+} bvh_node_t;
+
+typedef struct {
+	bvh_node_t *nodes;
+	size_t num_nodes;
+	size_t *items; // indices into the boxes it was built from
+	const bounds_t *boxes;
+	float (*centers)[3]; // only while building
+} bvh_t;
+
+// something that's cut by the region
+typedef struct {
+	entity_t *entity; // NULL for worldspawn brushes
+	brush_t *brush;
+} region_item_t;
+
+//
+// bounds
+//
+
+static void bounds_clear(bounds_t *bounds)
+{
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		bounds->mins[i] = INFINITY;
+		bounds->maxs[i] = -INFINITY;
+	}
+}
+
+static void bounds_add_point(bounds_t *bounds, const float *point)
+{
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		if (bounds->mins[i] > point[i])
+			bounds->mins[i] = point[i];
+		if (bounds->maxs[i] < point[i])
+			bounds->maxs[i] = point[i];
+	}
+}
+
+static bool bounds_empty(const bounds_t *bounds)
+{
+	return bounds->mins[0] > bounds->maxs[0];
+}
+
+static void bounds_add(bounds_t *bounds, const bounds_t *other)
+{
+	if (bounds_empty(other))
+		return;
+
+	bounds_add_point(bounds, other->mins);
+	bounds_add_point(bounds, other->maxs);
+}
+
+// note: touching counts
+static bool bounds_intersect(const bounds_t *a, const bounds_t *b)
+{
+	int i;
+
+	for (i = 0; i < 3; i++)
+		if (a->mins[i] > b->maxs[i] || a->maxs[i] < b->mins[i])
+			return false;
+
+	return true;
+}
+
+static void cross(double *out, const double *a, const double *b)
+{
+	out[0] = a[1] * b[2] - a[2] * b[1];
+	out[1] = a[2] * b[0] - a[0] * b[2];
+	out[2] = a[0] * b[1] - a[1] * b[0];
+}
+
+static double dot(const double *a, const double *b)
+{
+	return a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+}
+
+// the normal points out of the brush, like q3map2's PlaneFromPoints
+//RETURN VALUE
+//	0 on success, 1 if the points are on a line
+int plane_from_points(plane_t *plane, const float *def)
+{
+	double p0[3], d1[3], d2[3], len;
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		p0[i] = def[i];
+		d1[i] = def[3 + i] - p0[i];
+		d2[i] = def[6 + i] - p0[i];
+	}
+
+	cross(plane->normal, d2, d1);
+
+	len = sqrt(dot(plane->normal, plane->normal));
+	if (len < 1e-9)
+		return 1;
+
+	for (i = 0; i < 3; i++)
+		plane->normal[i] /= len;
+
+	plane->dist = dot(plane->normal, p0);
+	return 0;
+}
+
+//RETURN VALUE
+//	0 on success, 1 if the planes don't meet in a single point
+static int intersect_planes(double *out, const plane_t *a, const plane_t *b,
+                            const plane_t *c)
+{
+	double bc[3], ca[3], ab[3], det;
+	int i;
+
+	cross(bc, b->normal, c->normal);
+	cross(ca, c->normal, a->normal);
+	cross(ab, a->normal, b->normal);
+
+	det = dot(a->normal, bc);
+	if (fabs(det) < 1e-6)
+		return 1;
+
+	for (i = 0; i < 3; i++)
+		out[i] = (a->dist * bc[i] + b->dist * ca[i] +
+		          c->dist * ab[i]) / det;
+
+	return 0;
+}
+
+static bool inside_planes(const double *point, const plane_t *planes,
+                          size_t count)
+{
+	size_t i;
+
+	for (i = 0; i < count; i++)
+		if (dot(planes[i].normal, point) - planes[i].dist >
+		    PLANE_EPSILON)
+			return false;
+
+	return true;
+}
+
+static void face_points_bounds(bounds_t *bounds, const brush_t *brush)
+{
+	size_t i;
+
+	for (i = 0; i < brush->num_faces; i++) {
+		const float *def = brush->block->def[brush->first_face + i];
+
+		bounds_add_point(bounds, def);
+		bounds_add_point(bounds, def + 3);
+		bounds_add_point(bounds, def + 6);
+	}
+}
+
+//RETURN VALUE
+//	0 on success, 1 if out of memory
+static int brush_bounds(bounds_t *bounds, const brush_t *brush)
+{
+	const brush_patch_t *patch = brush->patch;
+	plane_t local[BRUSH_MAX_LOCAL_PLANES], *planes = local;
+	size_t i, j, k, count = 0;
+
+	bounds_clear(bounds);
+
+	if (patch) {
+		for (i = 0; i < patch->xres * patch->yres; i++)
+			bounds_add_point(bounds, patch->def + i * 5);
+
+		return 0;
+	}
+
+	if (brush->num_faces > BRUSH_MAX_LOCAL_PLANES) {
+		planes = malloc(brush->num_faces * sizeof(plane_t));
+		if (!planes)
+			return 1;
+	}
+
+	for (i = 0; i < brush->num_faces; i++)
+		if (!plane_from_points(planes + count,
+		                       brush->block->def[brush->first_face + i]))
+			count++;
+
+	for (i = 0; i < count; i++)
+	for (j = i + 1; j < count; j++)
+	for (k = j + 1; k < count; k++) {
+		double point[3];
+		float corner[3];
+
+		if (intersect_planes(point, planes + i, planes + j, planes + k))
+			continue;
+
+		if (!inside_planes(point, planes, count))
+			continue;
+
+		corner[0] = point[0];
+		corner[1] = point[1];
+		corner[2] = point[2];
+		bounds_add_point(bounds, corner);
+	}
+
+	if (planes != local)
+		free(planes);
+
+	// an open or inside out brush, the points it was given are all
+	// there is to go by
+	if (bounds_empty(bounds))
+		face_points_bounds(bounds, brush);
+
+	return 0;
+}
+
+//RETURN VALUE
+//	0 on success, 1 if out of memory
+static int entity_bounds(bounds_t *bounds, const entity_t *entity)
+{
+	const brush_t *brush;
+	const entity_key_t *key;
+
+	bounds_clear(bounds);
+
+	elist_cfor(brush, entity->brushes, list) {
+		bounds_t brush_box;
+
+		if (brush_bounds(&brush_box, brush))
+			return 1;
+
+		bounds_add(bounds, &brush_box);
+	}
+
+	if (!bounds_empty(bounds))
+		return 0;
+
+	elist_cfor(key, entity->keys, list) {
+		float origin[3];
+
+		if (key->key != intern_origin)
+			continue;
+
+		if (sscanf(key->value, "%f %f %f", origin, origin + 1,
+		           origin + 2) == 3)
+			bounds_add_point(bounds, origin);
+
+		break;
+	}
+
+	return 0;
+}
+
+//
+// bounding volume hierarchy
+//
+
+// partitions items so that the one at nth is where it'd be if they were
+// sorted along the axis and none of the ones before it are further along
+static void select_nth(bvh_t *bvh, size_t *items, size_t count, size_t nth,
+                       int axis)
+{
+	ptrdiff_t lo = 0, hi = count - 1, n = nth;
+
+	while (lo < hi) {
+		float pivot = bvh->centers[items[(lo + hi) / 2]][axis];
+		ptrdiff_t i = lo, j = hi;
+
+		while (i <= j) {
+			while (bvh->centers[items[i]][axis] < pivot)
+				i++;
+			while (bvh->centers[items[j]][axis] > pivot)
+				j--;
+
+			if (i <= j) {
+				size_t tmp = items[i];
+
+				items[i++] = items[j];
+				items[j--] = tmp;
+			}
+		}
+
+		if (n <= j)
+			hi = j;
+		else if (n >= i)
+			lo = i;
+		else
+			break;
+	}
+}
+
+static void bvh_build_node(bvh_t *bvh, size_t first, size_t count)
+{
+	bvh_node_t *node = bvh->nodes + bvh->num_nodes++;
+	bounds_t centers;
+	size_t i, left;
+	int axis = 0;
+
+	bounds_clear(&node->bounds);
+	bounds_clear(&centers);
+
+	for (i = first; i < first + count; i++) {
+		bounds_add(&node->bounds, bvh->boxes + bvh->items[i]);
+		bounds_add_point(&centers, bvh->centers[bvh->items[i]]);
+	}
+
+	node->first = first;
+	node->count = count;
+
+	if (count <= BVH_LEAF_SIZE)
+		return;
+
+	for (i = 1; i < 3; i++)
+		if (centers.maxs[i] - centers.mins[i] >
+		    centers.maxs[axis] - centers.mins[axis])
+			axis = i;
+
+	left = count / 2;
+	select_nth(bvh, bvh->items + first, count, left, axis);
+
+	node->count = 0;
+	bvh_build_node(bvh, first, left);
+	node->right = bvh->num_nodes;
+	bvh_build_node(bvh, first + left, count - left);
+}
+
+//RETURN VALUE
+//	0 on success, 1 if out of memory
+static int bvh_build(bvh_t *bvh, const bounds_t *boxes, size_t count)
+{
+	size_t i;
+	int j;
+
+	memset(bvh, 0, sizeof(*bvh));
+	bvh->boxes = boxes;
+
+	if (!count)
+		return 0;
+
+	// a binary tree with count leaves at most
+	bvh->nodes = malloc(2 * count * sizeof(bvh_node_t));
+	bvh->items = malloc(count * sizeof(size_t));
+	bvh->centers = malloc(count * sizeof(*bvh->centers));
+	if (!bvh->nodes || !bvh->items || !bvh->centers)
+		goto error_oom;
+
+	for (i = 0; i < count; i++) {
+		bvh->items[i] = i;
+
+		// empty boxes are never hit, where they go doesn't matter
+		for (j = 0; j < 3; j++)
+			bvh->centers[i][j] = bounds_empty(boxes + i) ? 0 :
+			                     (boxes[i].mins[j] +
+			                      boxes[i].maxs[j]) / 2;
+	}
+
+	bvh_build_node(bvh, 0, count);
+
+	free(bvh->centers);
+	bvh->centers = NULL;
+	return 0;
+
+error_oom:
+	free(bvh->nodes);
+	free(bvh->items);
+	free(bvh->centers);
+	return 1;
+}
+
+static void bvh_free(bvh_t *bvh)
+{
+	free(bvh->nodes);
+	free(bvh->items);
+}
+
+// sets hits[i] for every box i that intersects the query
+static void bvh_query(const bvh_t *bvh, const bounds_t *query, bool *hits)
+{
+	size_t stack[64], top = 0; // the tree is balanced
+	size_t i;
+
+	if (!bvh->num_nodes)
+		return;
+
+	stack[top++] = 0;
+
+	while (top) {
+		size_t n = stack[--top];
+		const bvh_node_t *node = bvh->nodes + n;
+
+		if (!bounds_intersect(&node->bounds, query))
+			continue;
+
+		if (!node->count) {
+			stack[top++] = node->right;
+			stack[top++] = n + 1;
+			continue;
+		}
+
+		for (i = node->first; i < node->first + node->count; i++)
+			if (bounds_intersect(bvh->boxes + bvh->items[i], query))
+				hits[bvh->items[i]] = true;
+	}
+}
+
+//
+// --region
+//
+
+static void drop_brush(map_t *map, const brush_t *brush)
+{
+	if (brush->patch)
+		map->num_patches--;
+	else
+		map->num_brushes--;
+}
+
+static void drop_item(map_t *map, const region_item_t *item)
+{
+	const brush_t *brush;
+
+	if (!item->entity) {
+		elist_unlink(&map->worldspawn->brushes, item->brush, list);
+		drop_brush(map, item->brush);
+		map->worldspawn->modified = true;
+		return;
+	}
+
+	elist_unlink(&map->entities, item->entity, list);
+	map->num_entities--;
+
+	elist_cfor(brush, item->entity->brushes, list)
+		drop_brush(map, brush);
+}
+
+// drops the worldspawn brushes and the entities that are entirely outside
+// the box (mins, maxs)
+//RETURN VALUE
+//	0 on success, 1 if out of memory
+int map_region(map_t *map, const float *mins, const float *maxs)
+{
+	int rv = 1;
+	region_item_t *items = NULL;
+	bounds_t *boxes = NULL, region;
+	bool *hits = NULL;
+	size_t i, count = 0;
+	entity_t *entity;
+	brush_t *brush;
+	bvh_t bvh;
+
+	memset(&bvh, 0, sizeof(bvh));
+	memcpy(region.mins, mins, sizeof(region.mins));
+	memcpy(region.maxs, maxs, sizeof(region.maxs));
+
+	if (map->worldspawn)
+		elist_for(brush, map->worldspawn->brushes, list)
+			count++;
+
+	elist_for(entity, map->entities, list)
+		count++;
+
+	items = malloc(count * sizeof(region_item_t));
+	boxes = malloc(count * sizeof(bounds_t));
+	hits = calloc(count, sizeof(bool));
+	if (count && (!items || !boxes || !hits))
+		goto error_oom;
+
+	count = 0;
+
+	if (map->worldspawn)
+		elist_for(brush, map->worldspawn->brushes, list) {
+			items[count].entity = NULL;
+			items[count].brush = brush;
+			if (brush_bounds(boxes + count, brush))
+				goto error_oom;
+			count++;
+		}
+
+	elist_for(entity, map->entities, list) {
+		items[count].entity = entity;
+		items[count].brush = NULL;
+		if (entity_bounds(boxes + count, entity))
+			goto error_oom;
+
+		// the ones that are nowhere are kept
+		if (bounds_empty(boxes + count))
+			hits[count] = true;
+
+		count++;
+	}
+
+	if (bvh_build(&bvh, boxes, count))
+		goto error_oom;
+
+	bvh_query(&bvh, &region, hits);
+
+	for (i = 0; i < count; i++)
+		if (!hits[i])
+			drop_item(map, items + i);
+
+	rv = 0;
+	goto out;
+
+error_oom:
+	fprintf(stderr, "error: out of memory\n");
+out:
+	bvh_free(&bvh);
+	free(items);
+	free(boxes);
+	free(hits);
+	return rv;
+}
@@ -0,0 +1,372 @@
+/*
+Copyright (C) 2016  Paweł Redman
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 3
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software Foundation,
+Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+*/
+
+// The first stage of the lexer. Every function here returns the length of
+// the longest prefix of [p, e) that doesn't contain a single byte that could
+// change the lexer's state in a given context. read_buffer consumes such runs
+// in bulk and only runs its per-byte state machine on the bytes in between.
+
+#include "common.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_X86
+#endif
+
+// isspace in the C locale, minus the newline (which has to go through the
+// state machine to bump the line counter)
+static inline bool is_blank(unsigned char ch)
+{
+	return ch == ' ' || (ch >= '\t' && ch <= '\r' && ch != '\n');
+}
+
+static inline bool is_bare_end(unsigned char ch)
+{
+	return ch == ' ' || (ch >= '\t' && ch <= '\r') ||
+	       ch == '\"' || ch == '/';
+}
+
+static inline bool is_quoted_end(unsigned char ch)
+{
+	return ch == '\"' || ch == '/' || ch == '\n';
+}
+
+static inline bool is_structure(unsigned char ch)
+{
+	return ch == '\"' || ch == '/' || ch == '\n' || ch == '{' || ch == '}';
+}
+
+//
+// scalar versions (also used for the tails of the vector versions)
+//
+
+static size_t scan_space_scalar(const char *p, const char *e)
+{
+	const char *s = p;
+
+	while (p < e && is_blank(*p))
+		p++;
+
+	return p - s;
+}
+
+static size_t scan_bare_scalar(const char *p, const char *e)
+{
+	const char *s = p;
+
+	while (p < e && !is_bare_end(*p))
+		p++;
+
+	return p - s;
+}
+
+static size_t scan_quoted_scalar(const char *p, const char *e)
+{
+	const char *s = p;
+
+	while (p < e && !is_quoted_end(*p))
+		p++;
+
+	return p - s;
+}
+
+static size_t scan_structure_scalar(const char *p, const char *e)
+{
+	const char *s = p;
+
+	while (p < e && !is_structure(*p))
+		p++;
+
+	return p - s;
+}
+
+#ifdef SCAN_X86
+
+//
+// SSE2
+//
+
+// 0xFF for every byte in [lo, lo + n]
+static inline __m128i sse2_range(__m128i v, char lo, char n)
+{
+	__m128i t;
+
+	t = _mm_sub_epi8(v, _mm_set1_epi8(lo));
+	return _mm_cmpeq_epi8(_mm_min_epu8(t, _mm_set1_epi8(n)), t);
+}
+
+static inline __m128i sse2_space(__m128i v)
+{
+	return _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+	                    sse2_range(v, '\t', '\r' - '\t'));
+}
+
+static size_t scan_space_sse2(const char *p, const char *e)
+{
+	const char *s = p;
+
+	for (; e - p >= 16; p += 16) {
+		__m128i v, m;
+		unsigned mask;
+
+		v = _mm_loadu_si128((const __m128i*)p);
+		m = _mm_andnot_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')),
+		                     sse2_space(v));
+		mask = ~_mm_movemask_epi8(m) & 0xFFFF;
+		if (mask)
+			return p - s + __builtin_ctz(mask);
+	}
+
+	return p - s + scan_space_scalar(p, e);
+}
+
+static size_t scan_bare_sse2(const char *p, const char *e)
+{
+	const char *s = p;
+
+	for (; e - p >= 16; p += 16) {
+		__m128i v, m;
+		unsigned mask;
+
+		v = _mm_loadu_si128((const __m128i*)p);
+		m = _mm_or_si128(sse2_space(v),
+		    _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\"')),
+		                 _mm_cmpeq_epi8(v, _mm_set1_epi8('/'))));
+		mask = _mm_movemask_epi8(m);
+		if (mask)
+			return p - s + __builtin_ctz(mask);
+	}
+
+	return p - s + scan_bare_scalar(p, e);
+}
+
+static size_t scan_quoted_sse2(const char *p, const char *e)
+{
+	const char *s = p;
+
+	for (; e - p >= 16; p += 16) {
+		__m128i v, m;
+		unsigned mask;
+
+		v = _mm_loadu_si128((const __m128i*)p);
+		m = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')),
+		    _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\"')),
+		                 _mm_cmpeq_epi8(v, _mm_set1_epi8('/'))));
+		mask = _mm_movemask_epi8(m);
+		if (mask)
+			return p - s + __builtin_ctz(mask);
+	}
+
+	return p - s + scan_quoted_scalar(p, e);
+}
+
+static size_t scan_structure_sse2(const char *p, const char *e)
+{
+	const char *s = p;
+
+	for (; e - p >= 16; p += 16) {
+		__m128i v, m;
+		unsigned mask;
+
+		v = _mm_loadu_si128((const __m128i*)p);
+		m = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')),
+		    _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\"')),
+		                 _mm_cmpeq_epi8(v, _mm_set1_epi8('/'))));
+		m = _mm_or_si128(m,
+		    _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('{')),
+		                 _mm_cmpeq_epi8(v, _mm_set1_epi8('}'))));
+		mask = _mm_movemask_epi8(m);
+		if (mask)
+			return p - s + __builtin_ctz(mask);
+	}
+
+	return p - s + scan_structure_scalar(p, e);
+}
+
+//
+// AVX2
+//
+
+#define AVX2 __attribute__((target("avx2")))
+
+static inline AVX2 __m256i avx2_range(__m256i v, char lo, char n)
+{
+	__m256i t;
+
+	t = _mm256_sub_epi8(v, _mm256_set1_epi8(lo));
+	return _mm256_cmpeq_epi8(_mm256_min_epu8(t, _mm256_set1_epi8(n)), t);
+}
+
+static inline AVX2 __m256i avx2_space(__m256i v)
+{
+	return _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')),
+	                       avx2_range(v, '\t', '\r' - '\t'));
+}
+
+static AVX2 size_t scan_space_avx2(const char *p, const char *e)
+{
+	const char *s = p;
+
+	for (; e - p >= 32; p += 32) {
+		__m256i v, m;
+		unsigned mask;
+
+		v = _mm256_loadu_si256((const __m256i*)p);
+		m = _mm256_andnot_si256(
+			_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')),
+			avx2_space(v));
+		mask = ~(unsigned)_mm256_movemask_epi8(m);
+		if (mask)
+			return p - s + __builtin_ctz(mask);
+	}
+
+	return p - s + scan_space_sse2(p, e);
+}
+
+static AVX2 size_t scan_bare_avx2(const char *p, const char *e)
+{
+	const char *s = p;
+
+	for (; e - p >= 32; p += 32) {
+		__m256i v, m;
+		unsigned mask;
+
+		v = _mm256_loadu_si256((const __m256i*)p);
+		m = _mm256_or_si256(avx2_space(v),
+		    _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\"')),
+		                    _mm256_cmpeq_epi8(v, _mm256_set1_epi8('/'))));
+		mask = _mm256_movemask_epi8(m);
+		if (mask)
+			return p - s + __builtin_ctz(mask);
+	}
+
+	return p - s + scan_bare_sse2(p, e);
+}
+
+static AVX2 size_t scan_quoted_avx2(const char *p, const char *e)
+{
+	const char *s = p;
+
+	for (; e - p >= 32; p += 32) {
+		__m256i v, m;
+		unsigned mask;
+
+		v = _mm256_loadu_si256((const __m256i*)p);
+		m = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')),
+		    _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\"')),
+		                    _mm256_cmpeq_epi8(v, _mm256_set1_epi8('/'))));
+		mask = _mm256_movemask_epi8(m);
+		if (mask)
+			return p - s + __builtin_ctz(mask);
+	}
+
+	return p - s + scan_quoted_sse2(p, e);
+}
+
+static AVX2 size_t scan_structure_avx2(const char *p, const char *e)
+{
+	const char *s = p;
+
+	for (; e - p >= 32; p += 32) {
+		__m256i v, m;
+		unsigned mask;
+
+		v = _mm256_loadu_si256((const __m256i*)p);
+		m = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')),
+		    _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\"')),
+		                    _mm256_cmpeq_epi8(v, _mm256_set1_epi8('/'))));
+		m = _mm256_or_si256(m,
+		    _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('{')),
+		                    _mm256_cmpeq_epi8(v, _mm256_set1_epi8('}'))));
+		mask = _mm256_movemask_epi8(m);
+		if (mask)
+			return p - s + __builtin_ctz(mask);
+	}
+
+	return p - s + scan_structure_sse2(p, e);
+}
+
+#endif // SCAN_X86
+
+//
+// entry points
+//
+
+#ifdef SCAN_X86
+static size_t (*scan_space_impl)(const char*, const char*) = scan_space_sse2;
+static size_t (*scan_bare_impl)(const char*, const char*) = scan_bare_sse2;
+static size_t (*scan_quoted_impl)(const char*, const char*) = scan_quoted_sse2;
+static size_t (*scan_structure_impl)(const char*, const char*) =
+	scan_structure_sse2;
+#else
+static size_t (*scan_space_impl)(const char*, const char*) = scan_space_scalar;
+static size_t (*scan_bare_impl)(const char*, const char*) = scan_bare_scalar;
+static size_t (*scan_quoted_impl)(const char*, const char*) = scan_quoted_scalar;
+static size_t (*scan_structure_impl)(const char*, const char*) =
+	scan_structure_scalar;
+#endif
+
+// picks the widest implementation the CPU supports before main runs, so
+// that the pointers above never change while the lexer is in use
+__attribute__((constructor)) static void scan_init(void)
+{
+#ifdef SCAN_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		scan_space_impl = scan_space_avx2;
+		scan_bare_impl = scan_bare_avx2;
+		scan_quoted_impl = scan_quoted_avx2;
+		scan_structure_impl = scan_structure_avx2;
+		debug("using AVX2\n");
+	}
+#endif
+}
+
+// whitespace between tokens (stops at newlines)
+size_t scan_space(const char *p, const char *e)
+{
+	return scan_space_impl(p, e);
+}
+
+// the inside of an unquoted token (stops at whitespace, quotes and slashes)
+size_t scan_bare(const char *p, const char *e)
+{
+	return scan_bare_impl(p, e);
+}
+
+// the inside of a quoted token (stops at quotes, slashes and newlines)
+size_t scan_quoted(const char *p, const char *e)
+{
+	return scan_quoted_impl(p, e);
+}
+
+// anything that affects the nesting of braces (stops at quotes, slashes,
+// newlines and braces)
+size_t scan_structure(const char *p, const char *e)
+{
+	return scan_structure_impl(p, e);
+}
+
+// the inside of a comment (stops at newlines)
+size_t scan_comment(const char *p, const char *e)
+{
+	const char *nl;
+
+	nl = memchr(p, '\n', e - p);
+	return (nl ? nl : e) - p;
+}
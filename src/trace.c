@@ -0,0 +1,160 @@
+/*
+Copyright (C) 2016  Paweł Redman
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 3
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software Foundation,
+Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+*/
+
+// --trace writes a timeline in the Chrome trace event format, which can be
+// opened in chrome://tracing or Perfetto. Spans are "complete" events
+// written when they end, counters are written as they change. Any thread
+// can write events (the file's lock keeps them whole), each one shows up
+// on its own track.
+//
+// When tracing is off, trace_begin and trace_end only check a pointer.
+
+#include "common.h"
+#include <time.h>
+#include <unistd.h>
+
+static FILE *trace_fp;
+static double trace_epoch;
+static bool trace_first = true; // no comma before the event
+static int trace_next_tid = 1;
+static __thread int trace_tid;
+
+static double now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec * 1e-3;
+}
+
+int trace_open(const char *path)
+{
+	trace_fp = fopen(path, "w");
+	if (!trace_fp) {
+		perror(path);
+		return 1;
+	}
+
+	trace_epoch = now_us();
+	fprintf(trace_fp, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [");
+	return 0;
+}
+
+int trace_close(const char *path)
+{
+	int rv = 0;
+
+	if (!trace_fp)
+		return 0;
+
+	fprintf(trace_fp, "\n]}\n");
+
+	if (ferror(trace_fp) | fclose(trace_fp)) {
+		perror(path);
+		rv = 1;
+	}
+
+	trace_fp = NULL;
+	return rv;
+}
+
+// starts an event and leaves the file locked
+static void begin_event(const char *ph, const char *name, double ts)
+{
+	if (!trace_tid)
+		trace_tid = __atomic_fetch_add(&trace_next_tid, 1,
+		                               __ATOMIC_RELAXED);
+
+	flockfile(trace_fp);
+	fprintf(trace_fp, "%s\n{\"ph\": \"%s\", \"name\": ", trace_first ? "" :
+	        ",", ph);
+	trace_first = false;
+	json_print_string(trace_fp, name);
+	fprintf(trace_fp, ", \"pid\": %ld, \"tid\": %d, \"ts\": %.3f",
+	        (long)getpid(), trace_tid, ts - trace_epoch);
+}
+
+//RETURN VALUE
+//	the start of a span, for trace_end
+double trace_begin(void)
+{
+	if (!trace_fp)
+		return 0;
+
+	return now_us();
+}
+
+// writes a span that began at start, path and bytes are its arguments
+// (if they're not NULL and 0)
+void trace_end(double start, const char *name, const char *path,
+               uint64_t bytes)
+{
+	double end;
+	const char *sep = "";
+
+	if (!trace_fp)
+		return;
+
+	end = now_us();
+	begin_event("X", name, start);
+	fprintf(trace_fp, ", \"dur\": %.3f, \"args\": {", end - start);
+
+	if (path) {
+		fprintf(trace_fp, "\"path\": ");
+		json_print_string(trace_fp, path);
+		sep = ", ";
+	}
+
+	if (bytes)
+		fprintf(trace_fp, "%s\"bytes\": %llu", sep,
+		        (unsigned long long)bytes);
+
+	fprintf(trace_fp, "}}");
+	funlockfile(trace_fp);
+}
+
+void trace_counter(const char *name, uint64_t value)
+{
+	if (!trace_fp)
+		return;
+
+	begin_event("C", name, now_us());
+	fprintf(trace_fp, ", \"args\": {\"value\": %llu}}",
+	        (unsigned long long)value);
+	funlockfile(trace_fp);
+}
+
+// the resident set size, right now
+void trace_rss(void)
+{
+	FILE *fp;
+	unsigned long size, resident;
+
+	if (!trace_fp)
+		return;
+
+	fp = fopen("/proc/self/statm", "r");
+	if (!fp)
+		return;
+
+	if (fscanf(fp, "%lu %lu", &size, &resident) == 2)
+		trace_counter("RSS (KB)", (uint64_t)resident *
+		              sysconf(_SC_PAGESIZE) / 1024);
+
+	fclose(fp);
+}